@@ -15,6 +15,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "bookmarksdb.h"
+#include "fulltextindexer.h"
 
 #include <QtGui>
 #include <QtSql>
@@ -22,7 +23,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 const QString DRIVER("QSQLITE");
 
-BookmarksDB::BookmarksDB(QString dbFile)
+BookmarksDB::BookmarksDB(QString dbFile) :
+    indexer(nullptr),
+    fullText(false)
 {
   if (QSqlDatabase::isDriverAvailable(DRIVER)) {
       db = QSqlDatabase::addDatabase(DRIVER);
@@ -50,6 +53,10 @@ BookmarksDB::BookmarksDB(QString dbFile)
                   QMessageBox::Cancel);
           }
           else {
+              // The full text indexer writes from its own connection while
+              // the dialogs read: readers are not blocked in WAL mode
+              query.exec("PRAGMA journal_mode = WAL;");
+
               if (!createDB()) {
                   QMessageBox::critical(
                       nullptr,
@@ -76,6 +83,11 @@ BookmarksDB::BookmarksDB(QString dbFile)
                   documentsDBModel->setHeaderData(Document_Name,      Qt::Horizontal, "Name");
                   documentsDBModel->setHeaderData(Document_Filename,  Qt::Horizontal, "Filename");
                   documentsDBModel->setHeaderData(Document_Thumbnail, Qt::Horizontal, "Thumbnail");
+
+                  if (fullText) {
+                      indexer = new FullTextIndexer(dbFile);
+                      indexer->start(QThread::LowestPriority);
+                  }
               }
           }
       }
@@ -85,6 +97,12 @@ BookmarksDB::BookmarksDB(QString dbFile)
 
 BookmarksDB::~BookmarksDB()
 {
+  if (indexer) {
+    indexer->abort();
+    indexer->wait();
+    delete indexer;
+  }
+
   QString name = db.databaseName();
 
   db.close();
@@ -172,9 +190,80 @@ bool BookmarksDB::createDB()
         return false;
     }
 
+    // Text of the pages of the documents, for the full text search. The
+    // SQLite library may have been built without FTS5: the search is then
+    // not available, the bookmarks are.
+    query.exec("CREATE VIRTUAL TABLE IF NOT EXISTS pages_text USING fts5("
+                 "text, "
+                 "document_id UNINDEXED, "
+                 "page_nbr UNINDEXED"
+               ");");
+    fullText = query.isActive();
+    if (!fullText) {
+        qWarning() << "Full text search not available: " << query.lastError().text();
+        return true;
+    }
+
+    query.exec("CREATE TABLE IF NOT EXISTS indexed_documents ("
+                 "document_id INTEGER PRIMARY KEY, "
+                 "mtime INTEGER, "
+                 "FOREIGN KEY(document_id) REFERENCES documents(id) "
+                   "ON DELETE CASCADE ON UPDATE CASCADE"
+               ");");
+    if (!query.isActive()) {
+        QMessageBox::critical(
+            nullptr,
+            QObject::tr("Cannot create table INDEXED_DOCUMENTS"),
+            QObject::tr("Unable to create database table Indexed_Documents.\n"
+                        "Database error: %1\n\n"
+                        "Click Cancel to exit.").arg(query.lastError().text()),
+            QMessageBox::Cancel);
+
+        return false;
+    }
+
     return true;
 }
 
+// Documents added or modified are indexed in the background
+void BookmarksDB::updateFullTextIndex()
+{
+    if (indexer) indexer->update();
+}
+
+// Ranked search of the pages of all the indexed documents. The text is
+// searched as a phrase.
+QList<FullTextHit> BookmarksDB::searchText(const QString & text, int limit)
+{
+    QList<FullTextHit> hits;
+
+    if (!fullText || text.trimmed().isEmpty()) return hits;
+
+    QSqlQuery query(db);
+    query.prepare("SELECT d.name, d.filename, pages_text.page_nbr, "
+                    "snippet(pages_text, 0, '[', ']', '...', 10) "
+                  "FROM pages_text JOIN documents d ON d.id = pages_text.document_id "
+                  "WHERE pages_text MATCH ? "
+                  "ORDER BY pages_text.rank LIMIT ?;");
+    query.addBindValue('"' + QString(text).replace('"', "\"\"") + '"');
+    query.addBindValue(limit);
+
+    if (!query.exec()) {
+        qDebug() << "Full text search problem: " << query.lastError().text();
+        return hits;
+    }
+
+    while (query.next()) {
+        hits.append({ query.value(0).toString(),
+                      query.value(1).toString(),
+                      query.value(2).toInt(),
+                      query.value(3).toString().simplified() });
+    }
+    query.finish();
+
+    return hits;
+}
+
 bool BookmarksDB::addEntry(QString filename,
                            QString caption,
                            QString authors,
@@ -240,6 +329,7 @@ bool BookmarksDB::addEntry(QString filename,
 
         if (saveAuthorsList(entriesModel->query().lastInsertId().toInt(), authors)) {
             db.commit();
+            updateFullTextIndex();
             return true;
         }
     }
@@ -26,6 +26,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 class QSqlTableModel;
 class QString;
 class DocumentModel;
+class FullTextIndexer;
 
 enum {
     Document_Id,
@@ -42,12 +43,22 @@ enum {
     Entry_Thumbnail
 };
 
+// A page of a bookmarked document containing the searched text
+struct FullTextHit {
+    QString name;
+    QString filename;
+    int     pageNbr;
+    QString snippet;    // Text around the hit, the hit between brackets
+};
+
 class BookmarksDB
 {
 private:
     QSqlDatabase     db;
     QSqlTableModel * entriesDBModel;
     DocumentModel  * documentsDBModel;
+    FullTextIndexer * indexer;
+    bool             fullText;         // The SQLite library supports FTS5
 
     QString check(QString str) { qDebug() << str; return str; }
 public:
@@ -66,6 +77,9 @@ public:
     void                 saveEntryThumbnail(const QModelIndex & index, QImage & image);
     QString                  getAuthorsList(int entryId);
     bool                    saveAuthorsList(int entryId, const QString & list);
+    bool                  fullTextAvailable() { return fullText; }
+    void                updateFullTextIndex();
+    QList<FullTextHit>           searchText(const QString & text, int limit = 100);
 };
 
 #endif // BOOKMARKSDB_H
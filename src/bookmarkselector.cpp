@@ -7,6 +7,7 @@
 #include <QDebug>
 #include <QFileInfo>
 #include <QBuffer>
+#include <QListWidgetItem>
 
 BookmarkSelector::BookmarkSelector(QWidget *parent) :
     QDialog(parent),
@@ -44,6 +45,16 @@ BookmarkSelector::BookmarkSelector(QWidget *parent) :
     connect(ui->cancelButton,           SIGNAL(clicked()),                  this, SLOT(                   reject()));
     connect(ui->selectButton,           SIGNAL(clicked()),                  this, SLOT(              selectEntry()));
 
+    connect(ui->textSearchButton,       SIGNAL(pressed()),                  this, SLOT(               searchText()));
+    connect(ui->textSearchEdit,         SIGNAL(returnPressed()),            this, SLOT(               searchText()));
+    connect(ui->textHitsView,           SIGNAL(itemDoubleClicked(QListWidgetItem *)),
+            this,                       SLOT(textHitSelect(QListWidgetItem *)));
+
+    // Documents added or modified since the last time are indexed while
+    // the dialog is in use
+    ui->textSearchWidget->setVisible(bookmarksDB->fullTextAvailable());
+    bookmarksDB->updateFullTextIndex();
+
     documentsModel->select();
 
     const QModelIndex & idx = documentsModel->index(0, Document_Name);
@@ -193,6 +204,33 @@ void BookmarkSelector::paintEvent(QPaintEvent * event)
     QDialog::paintEvent(event);
 }
 
+// The hits are ranked by relevance, all documents included
+void BookmarkSelector::searchText()
+{
+    ui->textHitsView->clear();
+
+    const QList<FullTextHit> hits = bookmarksDB->searchText(ui->textSearchEdit->text());
+
+    for (const FullTextHit & hit : hits) {
+        QListWidgetItem * item = new QListWidgetItem(
+            QString(tr("%1, page %2\n%3")).arg(hit.name).arg(hit.pageNbr).arg(hit.snippet),
+            ui->textHitsView);
+        item->setData(Qt::UserRole,     hit.filename);
+        item->setData(Qt::UserRole + 1, hit.pageNbr);
+        item->setData(Qt::UserRole + 2, hit.name);
+    }
+}
+
+void BookmarkSelector::textHitSelect(QListWidgetItem * item)
+{
+    if (item != nullptr) {
+        sel->filename = item->data(Qt::UserRole    ).toString();
+        sel->pageNbr  = item->data(Qt::UserRole + 1).toInt();
+        sel->caption  = item->data(Qt::UserRole + 2).toString();
+        accept();
+    }
+}
+
 void BookmarkSelector::changeEntriesFilter()
 {
     const QModelIndex & idx = documentsModel->index(ui->documentsView->currentIndex().row(), Document_Name);
@@ -23,6 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "updf.h"
 
 class QSqlTableModel;
+class QListWidgetItem;
 
 namespace Ui {
 class BookmarkSelector;
@@ -53,6 +54,8 @@ private slots:
     void changeDocumentsFilter();
     void   changeEntriesFilter();
     void           selectEntry();
+    void            searchText();
+    void         textHitSelect(QListWidgetItem * item);
 
 private:
     Ui::BookmarkSelector * ui;
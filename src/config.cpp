@@ -18,13 +18,60 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <QString>
 #include <QRect>
 #include <QFileInfo>
+#include <QRegularExpression>
+#include <QStringList>
+#include <QDebug>
+
+#include <algorithm>
 
 #include "config.h"
+#include "pagecodec.h"
 
 #define CONFIG_VERSION "1.0"
 
 FileViewParameters *fileViewParameters = NULL;
 
+// The single page trims are saved in one value, "page:x,y,w,h" entries
+// separated by spaces, instead of a settings array with two keys per page
+static QString singlesToString(const QVector<SinglePageTrim> & singles)
+{
+  QStringList list;
+  for (const SinglePageTrim & s : singles) {
+    list.append(QString("%1:%2,%3,%4,%5")
+                  .arg(s.page)
+                  .arg(s.pageTrim.x()).arg(s.pageTrim.y())
+                  .arg(s.pageTrim.width()).arg(s.pageTrim.height()));
+  }
+  return list.join(' ');
+}
+
+static void sortSingles(QVector<SinglePageTrim> & singles)
+{
+  std::sort(singles.begin(), singles.end(),
+            [](const SinglePageTrim & a, const SinglePageTrim & b) { return a.page < b.page; });
+}
+
+static QVector<SinglePageTrim> singlesFromString(const QString & str)
+{
+  QVector<SinglePageTrim> singles;
+
+  const QStringList entries = str.split(' ', Qt::SkipEmptyParts);
+  singles.reserve(entries.size());
+
+  for (const QString & entry : entries) {
+    const QStringList fields = entry.split(QRegularExpression("[:,]"));
+    if (fields.size() != 5) {
+      qWarning() << "Ignoring invalid page trim" << entry << Qt::endl;
+      continue;
+    }
+    singles.append({ fields[0].toInt(),
+                     QRect(fields[1].toInt(), fields[2].toInt(), fields[3].toInt(), fields[4].toInt()) });
+  }
+
+  sortSingles(singles);
+  return singles;
+}
+
 void clearFileViewParameters()
 {
   FileViewParameters * curr = fileViewParameters;
@@ -32,7 +79,6 @@ void clearFileViewParameters()
 
   while (curr) {
     next = curr->next;
-    clearSingles(curr->customTrim);
     delete curr;
     curr = next;
   }
@@ -51,14 +97,11 @@ void saveToConfig(FileViewParameters & params)
   }
 
   if (rf) {
-    clearSingles(rf->customTrim);
     FileViewParameters * next = rf->next;
 
     *rf = params; // This will override rf->next...
     rf->next = next;
 
-    copySingles(params.customTrim, rf->customTrim);
-
     // prev is NULL if it's already the first entry in the list
     // if not, we put this file as the first in the list
     if (prev) {
@@ -71,7 +114,6 @@ void saveToConfig(FileViewParameters & params)
     rf = new FileViewParameters;
 
     *rf = params;
-    copySingles(params.customTrim, rf->customTrim);
 
     rf->next = fileViewParameters;
     fileViewParameters  = rf;
@@ -95,6 +137,10 @@ void loadConfig()
     preferences.recentGeometry          = cfg.value("recentGeometry",                   true).toBool();
     preferences.showLoadMetrics         = cfg.value("showLoadMetrics",                 false).toBool();
     preferences.logTrace                = cfg.value("logTrace",                        false).toBool();
+    preferences.vectorTrim              = cfg.value("vectorTrim",                      false).toBool();
+    preferences.pageCodec               = cfg.value("pageCodec",                     PCI_QOI).toInt();
+    preferences.cacheBudget             = cfg.value("cacheBudget",                         0).toInt();
+    preferences.diskCacheSize           = cfg.value("diskCacheSize",                     512).toInt();
     preferences.logFilename             = cfg.value("logFilename",           "/tmp/updf.log").toString();
     preferences.horizontalPadding       = cfg.value("horizontalPadding",                   4).toInt();
     preferences.verticalPadding         = cfg.value("verticalPadding",                     8).toInt();
@@ -110,7 +156,6 @@ void loadConfig()
       preferences.defaultView.viewMode      = ViewMode(cfg.value("viewMode"      ,                 VM_PAGE).toInt());
       preferences.defaultView.winGeometry            = cfg.value("winGeometry"   , QRect(50, 50, 800, 800)).toRect();
       preferences.defaultView.customTrim.initialized = false;
-      preferences.defaultView.customTrim.singles     = NULL;
 
     cfg.endGroup();
 
@@ -154,31 +199,23 @@ void loadConfig()
     rf->customTrim.odd         = cfg.value("odd"        , QRect(0, 0, 0, 0)).toRect();
     rf->customTrim.even        = cfg.value("even"       , QRect(0, 0, 0, 0)).toRect();
 
-    rf->customTrim.singles = NULL;
-
-    SinglePageTrim * sPrev = NULL,
-                   * sCurr = NULL;
-
-    int sCnt = cfg.beginReadArray("singles");
-
-    for (int j = 0; j < sCnt; j++) {
-      cfg.setArrayIndex(j);
-      sCurr = (SinglePageTrim *) xmalloc(sizeof(SinglePageTrim));
-
-      sCurr->page     = cfg.value("page",                     0).toInt();
-      sCurr->pageTrim = cfg.value("pageTrim", QRect(0, 0, 0, 0)).toRect();
+    // Previous versions saved one array entry per page
+    if (cfg.contains("pageTrims")) {
+      rf->customTrim.singles = singlesFromString(cfg.value("pageTrims").toString());
+    }
+    else {
+      int sCnt = cfg.beginReadArray("singles");
 
-      if (sPrev == NULL) {
-        rf->customTrim.singles = sCurr;
-      }
-      else {
-        sPrev->next = sCurr;
+      for (int j = 0; j < sCnt; j++) {
+        cfg.setArrayIndex(j);
+        rf->customTrim.singles.append({ cfg.value("page",                     0).toInt(),
+                                        cfg.value("pageTrim", QRect(0, 0, 0, 0)).toRect() });
       }
-      sPrev = sCurr;
-      sCurr->next = NULL;
+
+      cfg.endArray();
+      sortSingles(rf->customTrim.singles);
     }
 
-    cfg.endArray();
     cfg.endGroup();
 
     if (prev == NULL) {
@@ -212,6 +249,10 @@ void saveConfig()
     cfg.setValue("recentGeometry",          preferences.recentGeometry            );
     cfg.setValue("showLoadMetrics",         preferences.showLoadMetrics           );
     cfg.setValue("logTrace",                preferences.logTrace                  );
+    cfg.setValue("vectorTrim",              preferences.vectorTrim                );
+    cfg.setValue("pageCodec",               preferences.pageCodec                 );
+    cfg.setValue("cacheBudget",             preferences.cacheBudget               );
+    cfg.setValue("diskCacheSize",           preferences.diskCacheSize             );
     cfg.setValue("logFilename",             preferences.logFilename               );
     cfg.setValue("horizontalPadding",       preferences.horizontalPadding         );
     cfg.setValue("verticalPadding",         preferences.verticalPadding           );
@@ -263,21 +304,14 @@ void saveConfig()
       cfg.setValue("even", rf->customTrim.even);
     }
 
-    if (rf->customTrim.singles) {
-      cfg.beginWriteArray("singles");
-      SinglePageTrim * curr = rf->customTrim.singles;
-
-      int idx = 0;
-      while (curr) {
-        cfg.setArrayIndex(idx);
-        cfg.setValue("page", curr->page);
-        cfg.setValue("pageTrim", curr->pageTrim);
-
-        curr = curr->next;
-        idx += 1;
-      }
+    // The entry may have been written for another file or by a previous version
+    cfg.remove("singles");
 
-      cfg.endArray();
+    if (!rf->customTrim.singles.isEmpty()) {
+      cfg.setValue("pageTrims", singlesToString(rf->customTrim.singles));
+    }
+    else {
+      cfg.remove("pageTrims");
     }
 
     cfg.endGroup();
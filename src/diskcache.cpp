@@ -0,0 +1,202 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <cstring>
+
+#include "diskcache.h"
+
+// Bump when the rendering or the file layout changes: files from a
+// previous version are then ignored and eventually removed.
+#define DISK_CACHE_VERSION 1
+
+// Bytes hashed at both ends of the document
+#define DISK_CACHE_SAMPLE (64 * 1024)
+
+// The file is only read back on the machine that wrote it: the values are
+// saved in the host byte order.
+struct DiskCacheHeader {
+  char magic[8];
+  u32  version;
+  u32  pages;
+};
+
+struct DiskCacheEntry {
+  u32     w, h;
+  u16     left, right, top, bottom;
+  u32     uncompressed;
+  u32     size;           // 0 if the page was not rendered
+  quint64 offset;         // From the start of the file
+};
+
+static const char magic[8] = { 'U', 'P', 'D', 'F', 'P', 'A', 'G', 'E' };
+
+QString DiskCache::directory()
+{
+  return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/pages";
+}
+
+QString DiskCache::key(const QString & filename, bool vectorTrim)
+{
+  QFileInfo info(filename);
+  QFile     file(filename);
+
+  if (!file.open(QIODevice::ReadOnly)) return QString();
+
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+
+  hash.addData(info.absoluteFilePath().toUtf8());
+  hash.addData(QByteArray::number(info.size()));
+  hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+  hash.addData(QByteArray::number(vectorTrim ? 1 : 0));
+  hash.addData(QByteArray::number(DISK_CACHE_VERSION));
+
+  // Some tools rewrite a document without changing its size and time
+  hash.addData(file.read(DISK_CACHE_SAMPLE));
+  if (info.size() > DISK_CACHE_SAMPLE) {
+    file.seek(qMax(info.size() - DISK_CACHE_SAMPLE, (qint64) DISK_CACHE_SAMPLE));
+    hash.addData(file.read(DISK_CACHE_SAMPLE));
+  }
+
+  return QString::fromLatin1(hash.result().toHex());
+}
+
+QFile * DiskCache::load(const QString & key, CachedPage * cache, u32 pages)
+{
+  if (key.isEmpty()) return nullptr;
+
+  QFile * file = new QFile(directory() + "/" + key);
+
+  if (!file->open(QIODevice::ReadOnly)) {
+    delete file;
+    return nullptr;
+  }
+
+  const qint64 size = file->size();
+  const qint64 table = sizeof(DiskCacheHeader) + (qint64) pages * sizeof(DiskCacheEntry);
+
+  uchar * map = (size >= table) ? file->map(0, size) : nullptr;
+
+  const DiskCacheHeader * header  = (const DiskCacheHeader *) map;
+  const DiskCacheEntry  * entries = (const DiskCacheEntry  *) (map + sizeof(DiskCacheHeader));
+
+  bool valid = (map != nullptr) &&
+               (memcmp(header->magic, magic, sizeof(magic)) == 0) &&
+               (header->version == DISK_CACHE_VERSION) &&
+               (header->pages   == pages);
+
+  for (u32 i = 0; valid && (i < pages); i++) {
+    valid = (entries[i].offset >= (quint64) table) &&
+            (entries[i].offset + entries[i].size <= (quint64) size);
+  }
+
+  if (!valid) {
+    qWarning() << "Ignoring disk cache file" << file->fileName() << Qt::endl;
+    delete file;
+    return nullptr;
+  }
+
+  for (u32 i = 0; i < pages; i++) {
+    const DiskCacheEntry & entry = entries[i];
+    if (entry.size == 0) continue;
+
+    CachedPage & page = cache[i];
+
+    page.data         = QByteArray::fromRawData((const char *) map + entry.offset, entry.size);
+    page.uncompressed = entry.uncompressed;
+    page.w            = entry.w;
+    page.h            = entry.h;
+    page.left         = entry.left;
+    page.right        = entry.right;
+    page.top          = entry.top;
+    page.bottom       = entry.bottom;
+    page.state        = PS_READY;
+    page.rendered     = true;
+  }
+
+  // The modification time gives the least recently used files
+  file->setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+
+  return file;
+}
+
+bool DiskCache::save(const QString & key, const CachedPage * cache, u32 pages)
+{
+  if (key.isEmpty() || !QDir().mkpath(directory())) return false;
+
+  // Written to a temporary file and renamed: a file mapped by another
+  // instance is not modified
+  QSaveFile file(directory() + "/" + key);
+  if (!file.open(QIODevice::WriteOnly)) return false;
+
+  DiskCacheHeader header;
+  memcpy(header.magic, magic, sizeof(magic));
+  header.version = DISK_CACHE_VERSION;
+  header.pages   = pages;
+
+  QVector<DiskCacheEntry> entries(pages);
+  quint64 offset = sizeof(DiskCacheHeader) + (quint64) pages * sizeof(DiskCacheEntry);
+
+  for (u32 i = 0; i < pages; i++) {
+    const CachedPage & page  = cache[i];
+    DiskCacheEntry   & entry = entries[i];
+
+    entry.w            = page.w;
+    entry.h            = page.h;
+    entry.left         = page.left;
+    entry.right        = page.right;
+    entry.top          = page.top;
+    entry.bottom       = page.bottom;
+    entry.uncompressed = page.uncompressed;
+    entry.size         = page.data.size();
+    entry.offset       = offset;
+
+    offset += entry.size;
+  }
+
+  file.write((const char *) &header, sizeof(header));
+  file.write((const char *) entries.constData(), pages * sizeof(DiskCacheEntry));
+
+  for (u32 i = 0; i < pages; i++) {
+    if (!cache[i].data.isEmpty()) file.write(cache[i].data);
+  }
+
+  return file.commit();
+}
+
+void DiskCache::cleanup(qint64 maxSize)
+{
+  QDir dir(directory());
+
+  // Most recently used first
+  const QFileInfoList files = dir.entryInfoList(QDir::Files, QDir::Time);
+
+  qint64 total = 0;
+  for (const QFileInfo & info : files) {
+    total += info.size();
+    if (total > maxSize) {
+      if (details) qInfo() << "Removing disk cache file" << info.fileName() << Qt::endl;
+      QFile::remove(info.absoluteFilePath());
+    }
+  }
+}
@@ -0,0 +1,55 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <QFile>
+#include <QString>
+
+#include "updf.h"
+#include "pdffile.h"
+
+// Compressed pages and their metrics kept on disk between sessions, one
+// file per document in the user cache directory. A document opened again
+// gets its pages from there instead of rendering them. The least recently
+// used files are removed when the directory grows over its size limit.
+class DiskCache
+{
+  public:
+    // Name of the cache file of a document, computed from its path, size,
+    // modification time and a hash of its first and last bytes. Empty if
+    // the document can't be read.
+    static QString key(const QString & filename, bool vectorTrim);
+
+    // Map the cache file and point the pages data to it: nothing is
+    // copied. The returned file must stay open as long as the pages are
+    // in use. nullptr if there is no valid cache file for the document.
+    static QFile * load(const QString & key, CachedPage * cache, u32 pages);
+
+    // Save the pages already rendered. The pages without data are saved
+    // as absent and will be rendered when the document is opened again.
+    static bool    save(const QString & key, const CachedPage * cache, u32 pages);
+
+    // Remove the least recently used files until the cache directory
+    // size is under maxSize bytes
+    static void cleanup(qint64 maxSize);
+
+  private:
+    static QString directory();
+};
+
+#endif // DISKCACHE_H
@@ -21,8 +21,10 @@ DocumentTab::DocumentTab(QWidget *parent) :
 
 DocumentTab::~DocumentTab()
 {
-    filesCache->releaseFile(file);
+    // The viewer waits for its page decoders, which may still refer to
+    // the file pages
     delete pdfViewer;
+    filesCache->releaseFile(file);
 }
 
 QString DocumentTab::getFilename()
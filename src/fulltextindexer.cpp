@@ -0,0 +1,220 @@
+/*
+Copyright (C) 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fulltextindexer.h"
+#include "pdffile.h"
+
+#include <GlobalParams.h>
+#include <TextOutputDev.h>
+
+#include <QtSql>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDebug>
+
+static const QString DRIVER("QSQLITE");
+static const QString CONNECTION("fullTextIndexer");
+
+struct IndexedDocument {
+    int     id;
+    QString filename;
+    qint64  mtime;     // -1 if never indexed
+};
+
+FullTextIndexer::FullTextIndexer(const QString & dbFile) :
+    dbFilename(dbFile),
+    folderPrefix(preferences.bookmarksParameters.pdfFolderPrefix),
+    updateRequested(false)
+{
+    if (!globalParams) {
+        globalParams.reset(new GlobalParams());
+    }
+}
+
+void FullTextIndexer::update()
+{
+    QMutexLocker locker(&mutex);
+
+    folderPrefix    = preferences.bookmarksParameters.pdfFolderPrefix;
+    updateRequested = true;
+    condition.wakeAll();
+}
+
+// The document being indexed is not saved
+void FullTextIndexer::abort()
+{
+    QMutexLocker locker(&mutex);
+
+    aborting.storeRelaxed(1);
+    condition.wakeAll();
+}
+
+bool FullTextIndexer::abortCheck(void * data)
+{
+    return ((const QAtomicInt *) data)->loadRelaxed() != 0;
+}
+
+void FullTextIndexer::run()
+{
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase(DRIVER, CONNECTION);
+        db.setDatabaseName(dbFilename);
+
+        if (!db.open()) {
+            qWarning() << "Full text indexer: unable to open the database: " << db.lastError().text();
+        }
+        else {
+            QSqlQuery query(db);
+            query.exec("PRAGMA foreign_keys = ON;");
+            query.finish();
+
+            while (!aborting.loadRelaxed()) {
+                indexDocuments(db);
+
+                mutex.lock();
+                while (!updateRequested && !aborting.loadRelaxed()) condition.wait(&mutex);
+                updateRequested = false;
+                mutex.unlock();
+            }
+            db.close();
+        }
+    }
+
+    QSqlDatabase::removeDatabase(CONNECTION);
+}
+
+void FullTextIndexer::indexDocuments(QSqlDatabase & db)
+{
+    QSqlQuery query(db);
+
+    // The pages of the documents removed from the bookmarks. Their
+    // indexed_documents rows are deleted by the foreign key.
+    if (!query.exec("DELETE FROM pages_text WHERE document_id NOT IN (SELECT id FROM documents);")) {
+        qDebug() << "Full text cleanup problem: " << query.lastError().text();
+    }
+
+    if (!query.exec("SELECT d.id, d.filename, i.mtime FROM documents d "
+                    "LEFT JOIN indexed_documents i ON i.document_id = d.id;")) {
+        qDebug() << "Full text select problem: " << query.lastError().text();
+        return;
+    }
+
+    QList<IndexedDocument> documents;
+    while (query.next()) {
+        documents.append({ query.value(0).toInt(),
+                           query.value(1).toString(),
+                           query.value(2).isNull() ? -1 : query.value(2).toLongLong() });
+    }
+    query.finish();
+
+    mutex.lock();
+    QString prefix = folderPrefix;
+    mutex.unlock();
+    if (prefix.right(1) != "/") prefix += "/";
+
+    for (const IndexedDocument & doc : documents) {
+        if (aborting.loadRelaxed()) return;
+
+        const QString   filename = QFileInfo::exists(doc.filename) ? doc.filename : prefix + doc.filename;
+        const QFileInfo info(filename);
+        if (!info.exists()) continue;
+
+        const qint64 mtime = info.lastModified().toSecsSinceEpoch();
+        if (mtime == doc.mtime) continue;
+
+        // A document that can't be read (damaged, encrypted) is saved
+        // without pages: it is only tried again once modified
+        QStringList pages;
+        if (!extractText(filename, pages)) {
+            if (aborting.loadRelaxed()) return;
+            pages.clear();
+        }
+
+        if (saveText(db, doc.id, mtime, pages) && details) {
+            qInfo() << "Indexed" << pages.size() << "pages of" << doc.filename << Qt::endl;
+        }
+    }
+}
+
+// The whole text of each page, as it would be selected
+bool FullTextIndexer::extractText(const QString & filename, QStringList & pages)
+{
+    PDFDoc * pdf = PDFFile::openDoc(filename);
+
+    if (!pdf->isOk()) {
+        qDebug() << "Full text indexer: unable to open " << filename;
+        delete pdf;
+        return false;
+    }
+
+    for (int page = 0; page < pdf->getNumPages(); page++) {
+        TextPage * const text = PDFFile::buildTextLayout(pdf, page, abortCheck, (void *) &aborting);
+
+        if (aborting.loadRelaxed()) {
+            text->decRefCnt();
+            delete pdf;
+            return false;
+        }
+
+        // At 144 DPI, whatever the page rotation
+        const double size = 2 * qMax(pdf->getPageMediaWidth(page + 1), pdf->getPageMediaHeight(page + 1));
+
+        GooString * str = text->getText(0, 0, size, size, eolUnix);
+        pages.append(QString::fromUtf8(str->c_str()));
+        delete str;
+
+        text->decRefCnt();
+    }
+
+    delete pdf;
+    return true;
+}
+
+// All the pages of a document in one short transaction: the text is
+// extracted before, the database is not locked meanwhile.
+bool FullTextIndexer::saveText(QSqlDatabase & db, int documentId, qint64 mtime, const QStringList & pages)
+{
+    QSqlQuery query(db);
+
+    db.transaction();
+
+    query.prepare("DELETE FROM pages_text WHERE document_id = ?;");
+    query.addBindValue(documentId);
+    bool ok = query.exec();
+
+    query.prepare("INSERT INTO pages_text (text, document_id, page_nbr) VALUES (?, ?, ?);");
+    for (int page = 0; ok && (page < pages.size()); page++) {
+        query.addBindValue(pages[page]);
+        query.addBindValue(documentId);
+        query.addBindValue(page + 1);
+        ok = query.exec();
+    }
+
+    if (ok) {
+        query.prepare("INSERT OR REPLACE INTO indexed_documents (document_id, mtime) VALUES (?, ?);");
+        query.addBindValue(documentId);
+        query.addBindValue(mtime);
+        ok = query.exec();
+    }
+
+    if (!ok) {
+        qDebug() << "Full text insert problem: " << query.lastError().text();
+        db.rollback();
+        return false;
+    }
+
+    return db.commit();
+}
@@ -0,0 +1,61 @@
+/*
+Copyright (C) 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FULLTEXTINDEXER_H
+#define FULLTEXTINDEXER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QString>
+#include <QStringList>
+
+#include "updf.h"
+
+class QSqlDatabase;
+
+// Keeps the text of the pages of the bookmarked documents in the
+// pages_text FTS5 table of the bookmarks database. Runs in its own thread
+// with its own database connection. A document is indexed again when its
+// modification time changed since it was last indexed. Once done, waits
+// for update() to be called.
+class FullTextIndexer : public QThread
+{
+    Q_OBJECT
+
+public:
+    FullTextIndexer(const QString & dbFile);
+    void run() Q_DECL_OVERRIDE;
+
+    void update();   // Documents added or modified
+    void  abort();
+
+private:
+    QString        dbFilename;
+    QString        folderPrefix;     // Copy of the preference, under mutex
+    QAtomicInt     aborting;
+    QMutex         mutex;
+    QWaitCondition condition;
+    bool           updateRequested;
+
+    void     indexDocuments(QSqlDatabase & db);
+    bool      extractText(const QString & filename, QStringList & pages);
+    bool        saveText(QSqlDatabase & db, int documentId, qint64 mtime, const QStringList & pages);
+    static bool abortCheck(void * data);
+};
+
+#endif // FULLTEXTINDEXER_H
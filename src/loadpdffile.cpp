@@ -17,12 +17,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 //#include <ErrorCodes.h>
-#include <QThreadPool>
 #include <QDebug>
 
 #include "updf.h"
 #include "loadpdffile.h"
-#include "pdfpageworker.h"
 
 void LoadPDFFile::clean()
 {
@@ -34,17 +32,23 @@ void LoadPDFFile::clean()
     pdfLoader = nullptr;
   }
 
+  file.clearContexts();
+  file.clearTiles();
+  file.clearTextLayouts();
+  file.clearMetricsChanges();
+  file.contentBoxes.clear();
+
   if (file.cache) {
-    u32 i;
-    const u32 max = file.pages;
-    for (i = 0; i < max; i++) {
-      if (file.cache[i].ready) {
-        file.cache[i].data.clear();
-        file.cache[i].ready = false;
-      }
-    }
-    free(file.cache);
+    delete [] file.cache;
     file.cache = nullptr;
+    file.cachedBytes = 0;
+    file.usageClock  = 0;
+  }
+
+  // Unmapped once no page refers to it anymore
+  if (file.diskCache) {
+    delete file.diskCache;
+    file.diskCache = nullptr;
   }
 
   file.filename = "";
@@ -106,66 +110,30 @@ LoadPDFFile::LoadPDFFile(const QString & fname, PDFFile & pdfFile) :
 //        break;
 //    }
 
-  QByteArray ba = fname.toLatin1(); // This maybe not appropriate for non-latin languages
-  GooString gooname(ba.data());
-
   qDebug() << "Opening File: " << fname << Qt::endl;
 
-  PDFDoc * pdfDoc = new PDFDoc(std::unique_ptr<GooString>(&gooname));
-  if (!pdfDoc->isOk()) {
-    const int err = pdfDoc->getErrorCode();
-    QString msg = tr("Unknown.");
-
-    switch (err) {
-      case errOpenFile:
-      case errFileIO:
-        msg = tr("Couldn't open file.");
-      break;
-      case errBadCatalog:
-      case errDamaged:
-      case errPermission:
-        msg = tr("Damaged PDF file.");
-      break;
-    }
-
-    qCritical() << err << ", " << msg << Qt::endl;
-
-    // qCritical() << "Not Able To Open File [" << fname << "]: " << msg << Qt::endl;
-
-    return;
-  }
-
-  // Free the old one, clean all related parameters
-  if (pdfLoader) clean();
-
+  // The document is parsed and rendered by the loader thread. The
+  // file becomes valid when the loader signals it has been opened.
   file.filename = fname;
-  file.pdf      = pdfDoc;
-  file.pages    = file.pdf->getNumPages();
-  file.maxW     = file.maxH = 0;
-
-  // Start threaded magic
-  if (file.pages < 1) {
-    qCritical() << QString(tr("Couldn't open ")) << fname << QString(tr("perhaps it's corrupted?")) << Qt::endl;
-    return;
-  }
-
-  file.cache = (CachedPage *) xcalloc(file.pages, sizeof(CachedPage));
-
-  if (pdfLoader) delete pdfLoader;
-  pdfLoader = new PDFLoader(file);
 
-  connect(pdfLoader, SIGNAL(loadCompleted()), this, SLOT(      handleResults()));
-  connect(pdfLoader, SIGNAL(      refresh()), this, SLOT(pageReadyForRefresh()));
+  pdfLoader = new PDFLoader(fname, file);
 
-  // Do first page and wait for the result
-  QThreadPool::globalInstance()->start(new PDFPageWorker(file, 0));
-  QThreadPool::globalInstance()->waitForDone();
+  connect(pdfLoader, SIGNAL(   loadCompleted()), this,      SLOT(      handleResults()));
+  connect(pdfLoader, SIGNAL(         refresh()), this,      SLOT(pageReadyForRefresh()));
+  connect(pdfLoader, SIGNAL(          opened()), this,      SLOT(     documentOpened()));
+  connect(&file,     SIGNAL(  visibleChanged()), pdfLoader, SLOT(     visibleChanged()));
+  connect(&file,     SIGNAL(resolutionRequested(u32, float)),
+          pdfLoader, SLOT(    requestResolution(u32, float)));
+  connect(&file,     SIGNAL(tilesRequested(QList<TileKey>)),
+          pdfLoader, SLOT(    requestTiles(QList<TileKey>)));
 
-  //pdfLoader->dopage(0);
+  file.setLoading(true);
+  pdfLoader->start();
+}
 
+void LoadPDFFile::documentOpened()
+{
   file.setValid(true);
-  file.setLoading(true);
-  pdfLoader->start();   // Do the rest of the document
 }
 
 void LoadPDFFile::handleResults()
@@ -44,6 +44,7 @@ class LoadPDFFile : public QObject
   public slots:
     void       handleResults();
     void pageReadyForRefresh();
+    void      documentOpened();
 
   signals:
     void       refresh();
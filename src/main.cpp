@@ -1,6 +1,7 @@
 #include "mainwindow.h"
 #include <QApplication>
 #include <QStyleFactory>
+#include <QThreadPool>
 
 #include <stdio.h>
 #include <unistd.h>
@@ -15,21 +16,31 @@ int main(int argc, char *argv[])
     QApplication a(argc, argv);
 
     const struct option opts[] = {
-      { "details", 0, NULL, 'd' },
-      { "help",    0, NULL, 'h' },
-      { "version", 0, NULL, 'v' },
-      { NULL,      0, NULL,  0  }
+      { "codec-bench", 0, NULL, 'b' },
+      { "details",     0, NULL, 'd' },
+      { "help",        0, NULL, 'h' },
+      { "threads",     1, NULL, 't' },
+      { "version",     0, NULL, 'v' },
+      { NULL,          0, NULL,  0  }
     };
 
     while (1) {
-      const int c = getopt_long(argc, argv, "dhv", opts, NULL);
+      const int c = getopt_long(argc, argv, "bdht:v", opts, NULL);
       if (c == -1)
         break;
 
       switch (c) {
+        case 'b':
+          codecBench = true;
+        break;
         case 'd':
           details++;
         break;
+        case 't':
+          if (atoi(optarg) > 0) {
+            QThreadPool::globalInstance()->setMaxThreadCount(atoi(optarg));
+          }
+        break;
         case 'v':
           printf("%s\n", APP_VERSION);
           return 0;
@@ -37,9 +48,11 @@ int main(int argc, char *argv[])
         case 'h':
         default:
           printf("Usage: %s [options] file.pdf\n\n"
-            "   -d --details   Print RAM, timing details (use twice for more)\n"
-            "   -h --help      This help\n"
-            "   -v --version   Print version\n",
+            "   -b --codec-bench Compare the page cache codecs on the loaded documents\n"
+            "   -d --details     Print RAM, timing details (use twice for more)\n"
+            "   -h --help        This help\n"
+            "   -t --threads n   Number of rendering threads\n"
+            "   -v --version     Print version\n",
             argv[0]);
           return 0;
         break;
@@ -41,6 +41,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // Parameters at startup
 
 u32           details = 0;
+bool          codecBench = false;
 QString       filenameAtStartup;
 Preferences   preferences;
 BookmarksDB * bookmarksDB = nullptr;
@@ -105,6 +106,8 @@ MainWindow::MainWindow(QWidget *parent) :
   currentState.validDocument  = false;
   currentState.textSelection  = false;
   currentState.someClipText   = false;
+  currentState.searchHits     = -1;
+  currentState.searching      = false;
   currentState.columnCount    = 1;
   currentState.titlePageCount = 0;
 
@@ -148,6 +151,7 @@ void MainWindow::tabChange(int index)
     disconnect(ui->columnCountCombo,    SIGNAL(currentIndexChanged(int)), nullptr, nullptr);
     disconnect(ui->titlePageCountCombo, SIGNAL(currentIndexChanged(int)), nullptr, nullptr);
     disconnect(ui->currentPageEdit,     SIGNAL(    editingFinished()),    nullptr, nullptr);
+    disconnect(ui->searchEdit,          SIGNAL(      returnPressed()),    nullptr, nullptr);
     disconnect(ui->trimPageList,        SIGNAL(        itemClicked(QListWidgetItem *)), nullptr, nullptr);
 
     if (currentDocumentTab != nullptr) {
@@ -179,6 +183,13 @@ void MainWindow::tabChange(int index)
                 pdfViewer,
                 [=](){ currentDocumentTab->getPdfViewer()->gotoPage(ui->currentPageEdit->text().toInt() - 1); });
 
+        connect(ui->searchEdit,
+                static_cast<void(QLineEdit::*)()>(&QLineEdit::returnPressed),
+                pdfViewer,
+                [=](){ currentDocumentTab->getPdfViewer()->search(ui->searchEdit->text()); });
+
+        ui->searchEdit->setText(pdfViewer->searchText());
+
         connect(ui->trimPageList,
                 static_cast<void(QListWidget::*)(QListWidgetItem *)>(&QListWidget::itemClicked),
                 pdfViewer,
@@ -375,6 +386,14 @@ void MainWindow::updateButtons(ViewState & state)
     else {
       ui->copyButton->hide();
     }
+    if (state.searchHits >= 0) {
+      ui->searchLabel->setText(QString(tr("%1 hits%2")).arg(state.searchHits).arg(state.searching ? "..." : ""));
+      ui->searchLabel->show();
+    }
+    else {
+      ui->searchLabel->hide();
+    }
+
     ui->   columnCountCombo->setCurrentIndex(state.columnCount - 1);
     ui->titlePageCountCombo->setCurrentIndex(state.titlePageCount);
 
@@ -385,6 +404,7 @@ void MainWindow::updateButtons(ViewState & state)
     ui->      zoomOutButton->setEnabled(state.validDocument);
     ui->      viewModeCombo->setEnabled(state.validDocument);
     ui->    currentPageEdit->setEnabled(state.validDocument);
+    ui->         searchEdit->setEnabled(state.validDocument);
     ui->beginDocumentButton->setEnabled(state.validDocument);
     ui->  endDocumentButton->setEnabled(state.validDocument);
     ui-> previousPageButton->setEnabled(state.validDocument);
@@ -454,8 +474,7 @@ void MainWindow::saveFileParameters()
   if (currentDocumentTab && preferences.keepRecent) {
     FileViewParameters params;
 
-    params.customTrim.singles = NULL;
-    params.winGeometry        = geometry();
+    params.winGeometry = geometry();
 
     currentDocumentTab->getPdfViewer()->getFileViewParameters(params);
     saveToConfig(params);
@@ -504,7 +523,6 @@ void MainWindow::askPreferences()
   FileViewParameters currentView;
 
   currentView.customTrim.initialized = false;
-  currentView.customTrim.singles     = NULL;
   currentView.winGeometry            = geometry();
 
   if (currentDocumentTab != nullptr) {
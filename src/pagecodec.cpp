@@ -0,0 +1,528 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QBuffer>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <cstring>
+
+#ifdef HAVE_LZ4
+  #include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+#include "pagecodec.h"
+
+struct PageHeader {
+  u8  codec;
+  u8  format;   // QImage::Format
+  u16 reserved;
+  u32 width;
+  u32 height;
+};
+
+PageCodec::PageCodec(PageCodecId codecId, const char * codecName) :
+  codecId(codecId),
+  codecName(codecName)
+{
+
+}
+
+bool PageCodec::encode(const QImage & img, QByteArray & data) const
+{
+  const PageCodec * codec = supports(img) ? this : get(PCI_DEFLATE_FAST);
+
+  PageHeader header;
+  header.codec    = codec->codecId;
+  header.format   = img.format();
+  header.reserved = 0;
+  header.width    = img.width();
+  header.height   = img.height();
+
+  data.clear();
+  data.append((const char *) &header, sizeof(header));
+
+  return codec->encodePixels(img, data);
+}
+
+bool PageCodec::decode(const QByteArray & data, QImage & img)
+{
+  if (data.size() < (int) sizeof(PageHeader)) return false;
+
+  PageHeader header;
+  memcpy(&header, data.constData(), sizeof(header));
+
+  const PageCodec * codec = get(header.codec);
+  if (codec == nullptr) return false;
+
+  img = QImage(header.width, header.height, QImage::Format(header.format));
+  if (img.isNull()) return false;
+
+  if (img.format() == QImage::Format_Mono) img.setColorTable(monoColorTable());
+
+  return codec->decodePixels(data.constData() + sizeof(header),
+                             data.size()      - sizeof(header),
+                             img);
+}
+
+// ----- PNG -----
+//
+// Best compression of the codecs always available, but slow in both
+// directions.
+
+class PNGCodec : public PageCodec
+{
+  public:
+    PNGCodec() : PageCodec(PCI_PNG, "PNG") {}
+
+  protected:
+    bool encodePixels(const QImage & img, QByteArray & data) const Q_DECL_OVERRIDE
+    {
+      QBuffer buf(&data);
+      buf.open(QIODevice::WriteOnly | QIODevice::Append);
+      const bool result = img.save(&buf, "PNG", 50);
+      buf.close();
+
+      return result;
+    }
+
+    bool decodePixels(const char * src, int size, QImage & img) const Q_DECL_OVERRIDE
+    {
+      const QImage::Format format = img.format();
+
+      if (!img.loadFromData((const uchar *) src, size, "PNG")) return false;
+      if (img.format() != format) img = img.convertToFormat(format);
+
+      return true;
+    }
+};
+
+// ----- QOI -----
+//
+// The "Quite OK Image" format (https://qoiformat.org), limited to 32 bits
+// pixels. The channels are kept in memory order, the 4th being handled as
+// alpha. Very fast and good at the large uniform areas of most pages.
+
+#define QOI_OP_INDEX  0x00
+#define QOI_OP_DIFF   0x40
+#define QOI_OP_LUMA   0x80
+#define QOI_OP_RUN    0xC0
+#define QOI_OP_RGB    0xFE
+#define QOI_OP_RGBA   0xFF
+#define QOI_MASK_2    0xC0
+
+#define QOI_HASH(p) (((p)[0] * 3 + (p)[1] * 5 + (p)[2] * 7 + (p)[3] * 11) & 63)
+
+class QOICodec : public PageCodec
+{
+  public:
+    QOICodec() : PageCodec(PCI_QOI, "QOI") {}
+
+  protected:
+    bool supports(const QImage & img) const Q_DECL_OVERRIDE
+    {
+      return img.depth() == 32;
+    }
+
+    bool encodePixels(const QImage & img, QByteArray & data) const Q_DECL_OVERRIDE
+    {
+      const u32 w = img.width();
+      const u32 h = img.height();
+
+      // Worst case is 5 bytes per pixel
+      const int start = data.size();
+      data.resize(start + w * h * 5);
+      u8 * dst = (u8 *) data.data() + start;
+
+      u8  index[64][4];
+      u8  prev[4] = { 0, 0, 0, 255 };
+      u32 run     = 0;
+
+      memset(index, 0, sizeof(index));
+
+      for (u32 j = 0; j < h; j++) {
+        const u8 * px = img.constScanLine(j);
+
+        for (u32 i = 0; i < w; i++, px += 4) {
+          if (memcmp(px, prev, 4) == 0) {
+            if (++run == 62) {
+              *dst++ = QOI_OP_RUN | (run - 1);
+              run = 0;
+            }
+            continue;
+          }
+
+          if (run > 0) {
+            *dst++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+          }
+
+          const u32 hash = QOI_HASH(px);
+
+          if (memcmp(index[hash], px, 4) == 0) {
+            *dst++ = QOI_OP_INDEX | hash;
+          }
+          else {
+            memcpy(index[hash], px, 4);
+
+            if (px[3] == prev[3]) {
+              const s8 d0  = px[0] - prev[0];
+              const s8 d1  = px[1] - prev[1];
+              const s8 d2  = px[2] - prev[2];
+              const s8 d10 = d0 - d1;
+              const s8 d12 = d2 - d1;
+
+              if ((d0 > -3) && (d0 < 2) && (d1 > -3) && (d1 < 2) && (d2 > -3) && (d2 < 2)) {
+                *dst++ = QOI_OP_DIFF | ((d0 + 2) << 4) | ((d1 + 2) << 2) | (d2 + 2);
+              }
+              else if ((d10 > -9) && (d10 < 8) && (d1 > -33) && (d1 < 32) && (d12 > -9) && (d12 < 8)) {
+                *dst++ = QOI_OP_LUMA | (d1 + 32);
+                *dst++ = ((d10 + 8) << 4) | (d12 + 8);
+              }
+              else {
+                *dst++ = QOI_OP_RGB;
+                *dst++ = px[0];
+                *dst++ = px[1];
+                *dst++ = px[2];
+              }
+            }
+            else {
+              *dst++ = QOI_OP_RGBA;
+              memcpy(dst, px, 4);
+              dst += 4;
+            }
+          }
+
+          memcpy(prev, px, 4);
+        }
+      }
+
+      if (run > 0) *dst++ = QOI_OP_RUN | (run - 1);
+
+      data.resize(dst - (u8 *) data.data());
+
+      return true;
+    }
+
+    bool decodePixels(const char * src, int size, QImage & img) const Q_DECL_OVERRIDE
+    {
+      const u32 w = img.width();
+      const u32 h = img.height();
+
+      const u8 *       in  = (const u8 *) src;
+      const u8 * const end = in + size;
+
+      u8  index[64][4];
+      u8  px[4] = { 0, 0, 0, 255 };
+      u32 run   = 0;
+
+      memset(index, 0, sizeof(index));
+
+      for (u32 j = 0; j < h; j++) {
+        u8 * out = img.scanLine(j);
+
+        for (u32 i = 0; i < w; i++, out += 4) {
+          if (run > 0) {
+            run--;
+          }
+          else {
+            if (in >= end) return false;
+
+            const u8 b1 = *in++;
+
+            if (b1 == QOI_OP_RGB) {
+              if ((end - in) < 3) return false;
+              px[0] = *in++;
+              px[1] = *in++;
+              px[2] = *in++;
+            }
+            else if (b1 == QOI_OP_RGBA) {
+              if ((end - in) < 4) return false;
+              memcpy(px, in, 4);
+              in += 4;
+            }
+            else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+              memcpy(px, index[b1], 4);
+            }
+            else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+              px[0] += ((b1 >> 4) & 0x03) - 2;
+              px[1] += ((b1 >> 2) & 0x03) - 2;
+              px[2] += ( b1       & 0x03) - 2;
+            }
+            else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+              if (in >= end) return false;
+              const u8 b2 = *in++;
+              const s32 d1 = (b1 & 0x3F) - 32;
+              px[0] += d1 - 8 + ((b2 >> 4) & 0x0F);
+              px[1] += d1;
+              px[2] += d1 - 8 + ( b2       & 0x0F);
+            }
+            else {
+              run = b1 & 0x3F;
+            }
+
+            memcpy(index[QOI_HASH(px)], px, 4);
+          }
+
+          memcpy(out, px, 4);
+        }
+      }
+
+      return true;
+    }
+};
+
+// ----- Raw pixels codecs -----
+//
+// The image lines are compressed as a whole by a general purpose
+// compressor.
+
+class RawCodec : public PageCodec
+{
+  public:
+    RawCodec(PageCodecId codecId, const char * codecName) : PageCodec(codecId, codecName) {}
+
+  protected:
+    virtual bool   compress(const char * src, int size, QByteArray & data) const = 0;
+    virtual bool decompress(const char * src, int size, char * dst, int dstSize) const = 0;
+
+    bool encodePixels(const QImage & img, QByteArray & data) const Q_DECL_OVERRIDE
+    {
+      return compress((const char *) img.constBits(), img.sizeInBytes(), data);
+    }
+
+    bool decodePixels(const char * src, int size, QImage & img) const Q_DECL_OVERRIDE
+    {
+      return decompress(src, size, (char *) img.bits(), img.sizeInBytes());
+    }
+};
+
+class DeflateCodec : public RawCodec
+{
+  public:
+    DeflateCodec(PageCodecId codecId, const char * codecName, int level) :
+      RawCodec(codecId, codecName), level(level) {}
+
+  protected:
+    bool compress(const char * src, int size, QByteArray & data) const Q_DECL_OVERRIDE
+    {
+      data.append(qCompress((const uchar *) src, size, level));
+      return true;
+    }
+
+    bool decompress(const char * src, int size, char * dst, int dstSize) const Q_DECL_OVERRIDE
+    {
+      const QByteArray pixels = qUncompress((const uchar *) src, size);
+      if (pixels.size() != dstSize) return false;
+
+      memcpy(dst, pixels.constData(), dstSize);
+      return true;
+    }
+
+  private:
+    int level;
+};
+
+#ifdef HAVE_LZ4
+
+class LZ4Codec : public RawCodec
+{
+  public:
+    LZ4Codec() : RawCodec(PCI_LZ4, "LZ4") {}
+
+  protected:
+    bool compress(const char * src, int size, QByteArray & data) const Q_DECL_OVERRIDE
+    {
+      const int start = data.size();
+      data.resize(start + LZ4_compressBound(size));
+
+      const int result = LZ4_compress_default(src, data.data() + start, size, LZ4_compressBound(size));
+      data.resize(start + result);
+
+      return result > 0;
+    }
+
+    bool decompress(const char * src, int size, char * dst, int dstSize) const Q_DECL_OVERRIDE
+    {
+      return LZ4_decompress_safe(src, dst, size, dstSize) == dstSize;
+    }
+};
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+class ZstdCodec : public RawCodec
+{
+  public:
+    ZstdCodec(PageCodecId codecId, const char * codecName, int level) :
+      RawCodec(codecId, codecName), level(level) {}
+
+  protected:
+    bool compress(const char * src, int size, QByteArray & data) const Q_DECL_OVERRIDE
+    {
+      const int    start = data.size();
+      const size_t bound = ZSTD_compressBound(size);
+      data.resize(start + bound);
+
+      const size_t result = ZSTD_compress(data.data() + start, bound, src, size, level);
+      if (ZSTD_isError(result)) return false;
+
+      data.resize(start + result);
+      return true;
+    }
+
+    bool decompress(const char * src, int size, char * dst, int dstSize) const Q_DECL_OVERRIDE
+    {
+      const size_t result = ZSTD_decompress(dst, dstSize, src, size);
+      return !ZSTD_isError(result) && (result == (size_t) dstSize);
+    }
+
+  private:
+    int level;
+};
+
+#endif
+
+// ----- Codecs registry -----
+
+static const PageCodec ** codecs()
+{
+  static PNGCodec     png;
+  static QOICodec     qoi;
+  static DeflateCodec deflateFast(PCI_DEFLATE_FAST, "Deflate (fast)", 1);
+  static DeflateCodec deflate    (PCI_DEFLATE,      "Deflate",        6);
+
+  #ifdef HAVE_LZ4
+    static LZ4Codec   lz4;
+  #endif
+
+  #ifdef HAVE_ZSTD
+    static ZstdCodec  zstdFast(PCI_ZSTD_FAST, "Zstandard (fast)",  1);
+    static ZstdCodec  zstd    (PCI_ZSTD,      "Zstandard",         3);
+    static ZstdCodec  zstdMax (PCI_ZSTD_MAX,  "Zstandard (small)", 9);
+  #endif
+
+  static const PageCodec * list[PCI_COUNT] = {
+    &png,
+    &qoi,
+    &deflateFast,
+    &deflate,
+    #ifdef HAVE_LZ4
+      &lz4,
+    #else
+      nullptr,
+    #endif
+    #ifdef HAVE_ZSTD
+      &zstdFast, &zstd, &zstdMax
+    #else
+      nullptr, nullptr, nullptr
+    #endif
+  };
+
+  return list;
+}
+
+// Bits set are white
+QList<QRgb> PageCodec::monoColorTable()
+{
+  return QList<QRgb>() << qRgb(0, 0, 0) << qRgb(255, 255, 255);
+}
+
+const PageCodec * PageCodec::get(int id)
+{
+  if ((id < 0) || (id >= PCI_COUNT)) return nullptr;
+
+  return codecs()[id];
+}
+
+QList<const PageCodec *> PageCodec::available()
+{
+  QList<const PageCodec *> result;
+
+  for (int id = 0; id < PCI_COUNT; id++) {
+    if (codecs()[id] != nullptr) result.append(codecs()[id]);
+  }
+
+  return result;
+}
+
+// ----- Benchmark -----
+
+struct CodecStats {
+  qint64 encodeTime;  // ns
+  qint64 decodeTime;  // ns
+  qint64 size;
+  qint64 uncompressed;
+  u32    pages;
+  u32    errors;
+};
+
+static QMutex     statsMutex;
+static CodecStats stats[PCI_COUNT];
+
+void PageCodec::benchmark(const QImage & img)
+{
+  for (const PageCodec * codec : available()) {
+    QElapsedTimer timer;
+    QByteArray    data;
+    QImage        result;
+
+    timer.start();
+    bool ok = codec->encode(img, data);
+    const qint64 encodeTime = timer.nsecsElapsed();
+
+    timer.start();
+    ok = ok && decode(data, result);
+    const qint64 decodeTime = timer.nsecsElapsed();
+
+    ok = ok && (result == img);
+
+    QMutexLocker locker(&statsMutex);
+
+    CodecStats & s = stats[codec->id()];
+    s.encodeTime   += encodeTime;
+    s.decodeTime   += decodeTime;
+    s.size         += data.size();
+    s.uncompressed += img.sizeInBytes();
+    s.pages        += 1;
+    if (!ok) s.errors += 1;
+  }
+}
+
+void PageCodec::printBenchmark()
+{
+  QMutexLocker locker(&statsMutex);
+
+  for (const PageCodec * codec : available()) {
+    const CodecStats & s = stats[codec->id()];
+    if (s.pages == 0) continue;
+
+    qInfo() <<
+      qPrintable(codec->name().leftJustified(18)) <<
+      "pages:"   << s.pages <<
+      "encode:"  << (s.encodeTime / 1000 / s.pages) << "us/page" <<
+      "decode:"  << (s.decodeTime / 1000 / s.pages) << "us/page" <<
+      "ratio:"   << (100.0f * s.size / s.uncompressed) << "%" <<
+      "errors:"  << s.errors << Qt::endl;
+  }
+}
@@ -0,0 +1,81 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGECODEC_H
+#define PAGECODEC_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QString>
+
+#include "updf.h"
+
+// Codecs used to keep the rendered pages compressed in memory. The values
+// are saved in the configuration and in the encoded data: do not renumber.
+enum PageCodecId {
+  PCI_PNG = 0,
+  PCI_QOI,
+  PCI_DEFLATE_FAST,
+  PCI_DEFLATE,
+  PCI_LZ4,
+  PCI_ZSTD_FAST,
+  PCI_ZSTD,
+  PCI_ZSTD_MAX,
+  PCI_COUNT
+};
+
+// The encoded data starts with a small header giving the codec, the image
+// format and its size. Any page can then be decoded, whatever the codec
+// selected when it was encoded.
+class PageCodec
+{
+  public:
+    PageCodec(PageCodecId codecId, const char * codecName);
+    virtual ~PageCodec() {}
+
+    PageCodecId           id() const { return codecId;   }
+    QString             name() const { return codecName; }
+
+    bool              encode(const QImage & img, QByteArray & data) const;
+    static bool       decode(const QByteArray & data, QImage & img);
+
+    static const PageCodec *             get(int id);  // nullptr if not available
+    static QList<QRgb>            monoColorTable();   // For 1 bit pages
+    static QList<const PageCodec *> available();
+
+    // Encode and decode the image with every available codec, to compare
+    // them on the pages of real documents (--codec-bench option)
+    static void        benchmark(const QImage & img);
+    static void   printBenchmark();
+
+  protected:
+    // Image formats not supported are encoded with PCI_DEFLATE_FAST
+    virtual bool     supports(const QImage & img) const { Q_UNUSED(img); return true; }
+
+    // Append the compressed pixels of img to data
+    virtual bool encodePixels(const QImage & img, QByteArray & data) const = 0;
+
+    // Decompress the pixels into img, already allocated with the right
+    // size and format
+    virtual bool decodePixels(const char * src, int size, QImage & img) const = 0;
+
+  private:
+    PageCodecId  codecId;
+    const char * codecName;
+};
+
+#endif // PAGECODEC_H
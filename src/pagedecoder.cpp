@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pagedecoder.h"
+#include "pagecodec.h"
+
+PageDecoder::PageDecoder(const QByteArray & pageData, const u32 pageNbr, const float pageScale,
+                         const int decodeGeneration) :
+  data(pageData),
+  page(pageNbr),
+  scale(pageScale),
+  generation(decodeGeneration)
+{
+
+}
+
+void PageDecoder::run()
+{
+  QImage img;
+
+  if (!PageCodec::decode(data, img)) img = QImage();
+
+  // Gray and black and white pages would be converted by QPixmap in the
+  // GUI thread
+  if (!img.isNull() && (img.format() != QImage::Format_RGB32)) {
+    img = img.convertToFormat(QImage::Format_RGB32);
+  }
+
+  emit decoded(page, scale, generation, img);
+}
@@ -0,0 +1,49 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEDECODER_H
+#define PAGEDECODER_H
+
+#include <QObject>
+#include <QRunnable>
+#include <QByteArray>
+#include <QImage>
+
+#include "updf.h"
+
+// Decode a compressed page outside of the GUI thread. The viewer gets the
+// image through the decoded() signal, already in the format of the
+// pixmaps, and only has to draw it.
+class PageDecoder : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+  public:
+    PageDecoder(const QByteArray & pageData, const u32 pageNbr, const float pageScale,
+                const int decodeGeneration);
+    void run() Q_DECL_OVERRIDE;
+
+  private:
+    QByteArray data;        // Compressed page, shared with the cache
+    u32        page;
+    float      scale;
+    int        generation;  // Results from a previous document are ignored
+
+  signals:
+    void decoded(int page, float scale, int generation, QImage image);
+};
+
+#endif // PAGEDECODER_H
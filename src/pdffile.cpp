@@ -18,11 +18,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "pdffile.h"
 #include "loadpdffile.h"
 
+#include <SplashOutputDev.h>
+#include <TextOutputDev.h>
+#include <GlobalParams.h>
+#include <QDebug>
+
 PDFFile::PDFFile(QObject * parent) : QObject(parent),
   valid(false),
   loaded(false),
   loading(false),
   viewerCount(0),
+  loadedPDFFile(nullptr),
+  contextsCount(0),
+  contextsReused(0),
+  tiles(TILE_CACHE_MAX),
+  textLayouts(TEXT_CACHE_PAGES),
+  metricsBase(0),
   cache(NULL),
   pdf(NULL),
   pages(0),
@@ -30,8 +41,15 @@ PDFFile::PDFFile(QObject * parent) : QObject(parent),
   lastVisible(0),
   totalSize(0),
   totalSizeCompressed(0),
-  loadTime(0)
+  loadTime(0),
+  codec(nullptr),
+  cachedBytes(0),
+  usageClock(0),
+  diskCache(nullptr)
 {
+  refreshTimer = new QTimer(this);
+  refreshTimer->setSingleShot(true);
+  connect(refreshTimer, SIGNAL(timeout()), this, SLOT(refreshPages()));
 }
 
 PDFFile::~PDFFile()
@@ -60,13 +78,248 @@ void PDFFile::load(QString filename, int atPage)
   loadedPDFFile = new LoadPDFFile(filename, *this);
 }
 
+PDFDoc * PDFFile::openDoc(const QString & fname)
+{
+  QByteArray ba = fname.toLatin1(); // This maybe not appropriate for non-latin languages
+
+  return new PDFDoc(std::make_unique<GooString>(ba.data()));
+}
+
+// Get a rendering context for the exclusive use of the calling worker.
+// Must be given back with releaseContext() once the page is rendered.
+RenderContext * PDFFile::acquireContext()
+{
+  contextsMutex.lock();
+  if (!freeContexts.isEmpty()) {
+    RenderContext * context = freeContexts.takeLast();
+    contextsReused += 1;
+    contextsMutex.unlock();
+    return context;
+  }
+  contextsMutex.unlock();
+
+  // Opened outside of the lock: other workers may proceed meanwhile
+  PDFDoc * doc = openDoc(filename);
+  if (!doc->isOk()) {
+    qCritical() << "Unable to open a rendering instance of " << filename << Qt::endl;
+    delete doc;
+    return nullptr;
+  }
+
+  SplashColor     white   = { 255, 255, 255 };
+  RenderContext * context = new RenderContext;
+
+  context->doc    = doc;
+  context->splash = new SplashOutputDev(splashModeXBGR8, 4, false, white);
+  context->splash->startDoc(doc);
+
+  contextsMutex.lock();
+  contextsCount += 1;
+  contextsMutex.unlock();
+
+  return context;
+}
+
+void PDFFile::releaseContext(RenderContext * context)
+{
+  QMutexLocker locker(&contextsMutex);
+
+  freeContexts.append(context);
+}
+
+// To be called once all workers are done with this file
+void PDFFile::clearContexts()
+{
+  QMutexLocker locker(&contextsMutex);
+
+  for (RenderContext * context : freeContexts) {
+    delete context->splash;
+    delete context->doc;
+    delete context;
+  }
+  freeContexts.clear();
+  contextsCount  = 0;
+  contextsReused = 0;
+}
+
+// Free the unused contexts above maxCount, opened while other jobs, as
+// the searches, were run next to the rendering workers
+void PDFFile::trimContexts(u32 maxCount)
+{
+  QMutexLocker locker(&contextsMutex);
+
+  while ((contextsCount > maxCount) && !freeContexts.isEmpty()) {
+    RenderContext * context = freeContexts.takeLast();
+    delete context->splash;
+    delete context->doc;
+    delete context;
+    contextsCount -= 1;
+  }
+}
+
+// Tiles are cached uncompressed: they are only rendered while zoomed in
+// and are drawn as is.
+void PDFFile::insertTile(const TileKey & key, const QImage & image)
+{
+  QMutexLocker locker(&cacheMutex);
+
+  tiles.insert(key, new QImage(image), image.sizeInBytes());
+}
+
+bool PDFFile::getTile(const TileKey & key, QImage & image)
+{
+  QMutexLocker locker(&cacheMutex);
+
+  QImage * tile = tiles.object(key);
+  if (tile == nullptr) return false;
+
+  image = *tile;
+  return true;
+}
+
+void PDFFile::clearTiles()
+{
+  QMutexLocker locker(&cacheMutex);
+
+  tiles.clear();
+}
+
+TextLayout::~TextLayout()
+{
+  text->decRefCnt();
+}
+
+// Interpret the page with a text output device, at the resolution of the
+// cached pages: the selection coordinates can be used as is. The caller
+// owns a reference to the result.
+TextPage * PDFFile::buildTextLayout(PDFDoc * doc, u32 page, bool (* abortCheck)(void *), void * abortData)
+{
+  TextOutputDev dev(nullptr, true, 0, false, false);
+
+  doc->displayPage(&dev, page + 1, 144, 144, 0, true, false, false, abortCheck, abortData);
+
+  return dev.takeText();
+}
+
+// Each page counts as one entry, whatever the amount of text it contains
+void PDFFile::insertTextLayout(u32 page, TextPage * text)
+{
+  QMutexLocker locker(&textMutex);
+
+  textLayouts.insert(page, new TextLayout { text });
+}
+
+bool PDFFile::hasTextLayout(u32 page)
+{
+  QMutexLocker locker(&textMutex);
+
+  return textLayouts.contains(page);
+}
+
+// Text in the area, in page coordinates at 144 DPI. false if the text
+// layout of the page is not built yet.
+bool PDFFile::getText(u32 page, const QRectF & area, QString & text)
+{
+  QMutexLocker locker(&textMutex);
+
+  TextLayout * layout = textLayouts.object(page);
+  if (layout == nullptr) return false;
+
+  GooString * str = layout->text->getText(area.left(), area.top(), area.right(), area.bottom(),
+                                          globalParams->getTextEOL());
+  text = QString::fromUtf8(str->c_str());
+  delete str;
+
+  return true;
+}
+
+void PDFFile::clearTextLayouts()
+{
+  QMutexLocker locker(&textMutex);
+
+  textLayouts.clear();
+}
+
+void PDFFile::setVisible(u32 first, u32 last)
+{
+  if ((first == firstVisible) && (last == lastVisible)) return;
+
+  firstVisible = first;
+  lastVisible  = last;
+
+  emit visibleChanged();
+}
+
+void PDFFile::requestResolution(u32 page, float scale)
+{
+  emit resolutionRequested(page, scale);
+}
+
+// Called after each repaint with the visible tiles still missing. Tiles
+// previously requested and not in the list are no longer needed.
+void PDFFile::requestTiles(const QList<TileKey> & keys)
+{
+  emit tilesRequested(keys);
+}
+
 void PDFFile::setLoaded(bool val)
 {
   loaded = val;
   if (loaded)  emit fileLoadCompleted();
 }
 
+// Called by the workers when a visible page is rendered. Only the first
+// page of a batch has to be signaled: the others will be refreshed with it.
+bool PDFFile::pageReady(u32 page)
+{
+  QMutexLocker locker(&readyMutex);
+
+  if (!readyPages.contains(page)) readyPages.append(page);
+  return readyPages.size() == 1;
+}
+
+// Called by the workers when the size or margins of a page are known. The
+// viewer updates the layout of those pages only.
+void PDFFile::metricsChanged(u32 page)
+{
+  QMutexLocker locker(&readyMutex);
+
+  newMetrics.append(page);
+}
+
+// Pages with new metrics since position, which is then moved to the end
+// of the list. A position from a previous document gets all of them.
+QList<u32> PDFFile::metricsChangesSince(u32 & position)
+{
+  QMutexLocker locker(&readyMutex);
+
+  const QList<u32> pages = (position >= metricsBase) ? newMetrics.mid(position - metricsBase) : newMetrics;
+  position = metricsBase + newMetrics.size();
+  return pages;
+}
+
+// Positions keep increasing: the viewers positions stay meaningful
+void PDFFile::clearMetricsChanges()
+{
+  QMutexLocker locker(&readyMutex);
+
+  metricsBase += newMetrics.size();
+  newMetrics.clear();
+}
+
+// A batch of pages started. They are refreshed after REFRESH_INTERVAL,
+// with the pages rendered in the meantime.
 void PDFFile::pageCompleted()
 {
-  emit pageLoadCompleted();
+  if (!refreshTimer->isActive()) refreshTimer->start(REFRESH_INTERVAL);
+}
+
+void PDFFile::refreshPages()
+{
+  readyMutex.lock();
+  const QList<u32> pages = readyPages;
+  readyPages.clear();
+  readyMutex.unlock();
+
+  if (!pages.isEmpty()) emit pagesReady(pages);
 }
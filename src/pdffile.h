@@ -18,10 +18,31 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define PDFFILE_H
 
 #include <QObject>
+#include <QMutex>
+#include <QList>
+#include <QCache>
+#include <QImage>
+#include <QRect>
+#include <QVector>
+#include <QTimer>
 
 #include "updf.h"
 
 class LoadPDFFile;
+class SplashOutputDev;
+class TextPage;
+class PageCodec;
+class QFile;
+
+// Rendering state of a page. An evicted page keeps its metrics and
+// preview, and is rendered again when it comes back close to the view.
+enum PageState : u8 {
+  PS_ABSENT = 0,  // Not rendered yet
+  PS_QUEUED,      // Given to a worker
+  PS_RENDERING,   // Being rendered
+  PS_READY,       // Compressed data available
+  PS_EVICTED      // Data dropped to stay within the memory budget
+};
 
 struct CachedPage {
   QByteArray data;
@@ -31,7 +52,73 @@ struct CachedPage {
   u32   w, h;
   u16   left, right, top, bottom;
 
-  bool  ready;
+  PageState state;     // Data is protected by PDFFile::cacheMutex
+  u32       lastUsed;  // Last time drawn by the viewer, for eviction. Under cacheMutex
+  bool      rendered;  // Rendered at least once, metrics are exact
+
+  bool isReady() const { return state == PS_READY; }
+
+  // Low resolution version, rendered at PREVIEW_SCALE during a first pass
+  // over the document. The metrics above come from it until the page is
+  // ready.
+  QByteArray previewData;
+  bool       previewReady;
+
+  bool hasMetrics() const { return rendered || previewReady; }
+
+  // Sharper version of the same trimmed area, rendered at the scale the
+  // page is drawn on screen. Protected by PDFFile::cacheMutex.
+  QByteArray hiresData;
+  float      hiresScale; // Relative to the 144 DPI version, 0 if none
+};
+
+// The preview pass renders at 36 DPI, a fourth of the usual resolution
+#define PREVIEW_SCALE       0.25f
+
+// At high zoom, pages are rendered by tiles of TILE_SIZE x TILE_SIZE pixels.
+// Only the visible ones are rendered. They are kept in a cache limited to
+// TILE_CACHE_MAX bytes.
+#define TILE_SIZE           512
+#define TILE_CACHE_MAX     (128 * 1024 * 1024)
+
+// The text layouts of the visible pages are built by the workers, for the
+// text selection. Those of the TEXT_CACHE_PAGES most recently used pages
+// are kept.
+#define TEXT_CACHE_PAGES    64
+
+// Pages rendered within this delay (in ms, about a display frame) are
+// refreshed by a single repaint
+#define REFRESH_INTERVAL    16
+
+struct TileKey {
+  u32   page;
+  float scale;     // Relative to the 144 DPI version
+  u16   x, y;      // Tile position in the page rendered at that scale
+
+  bool operator==(const TileKey & other) const {
+    return (page  == other.page ) && (scale == other.scale) &&
+           (x     == other.x    ) && (y     == other.y    );
+  }
+};
+
+inline size_t qHash(const TileKey & key, size_t seed = 0)
+{
+  return qHashMulti(seed, key.page, key.scale, key.x, key.y);
+}
+
+// A rendering context is used by one worker at a time. The output device
+// stays with its document from one page to the next, so that the Splash
+// font engine, glyph cache and buffers are retained.
+struct RenderContext {
+  PDFDoc          * doc;
+  SplashOutputDev * splash;
+};
+
+// Text layout of a page at 144 DPI, as built by poppler. Never modified
+// once built: the selected text is extracted from it in any thread.
+struct TextLayout {
+  TextPage * text;
+  ~TextLayout();
 };
 
 class PDFFile : public QObject
@@ -44,6 +131,28 @@ class PDFFile : public QObject
     int             viewerCount;
     LoadPDFFile *   loadedPDFFile;
 
+    // Rendering contexts pool. Each worker gets its own PDFDoc instance
+    // so that parser, xref and stream states are never shared between
+    // threads. They are opened on demand, at most one per pool thread.
+    QMutex                 contextsMutex;
+    QList<RenderContext *> freeContexts;
+    u32                    contextsCount;
+    u32                    contextsReused;
+
+    QCache<TileKey, QImage> tiles;     // Protected by cacheMutex
+
+    QMutex                  textMutex;
+    QCache<u32, TextLayout> textLayouts; // Protected by textMutex
+
+    QMutex                 readyMutex;
+    QList<u32>             readyPages; // Visible pages rendered since the last refresh
+    // Pages with new metrics, protected by readyMutex. Shared by all the
+    // viewers of the file: each one keeps its own position in the list.
+    // metricsBase is the position of its first entry.
+    QList<u32>             newMetrics;
+    u32                    metricsBase;
+    QTimer               * refreshTimer;
+
   public:
     explicit PDFFile(QObject * parent = 0);
     ~PDFFile();
@@ -58,6 +167,15 @@ class PDFFile : public QObject
     u32          totalSize;
     u32          totalSizeCompressed;
     u32          loadTime;
+    QMutex       cacheMutex;
+    const PageCodec * codec;       // Used to compress the rendered pages
+    qint64       cachedBytes;      // Compressed pages size, under cacheMutex
+    u32          usageClock;       // Incremented by the viewer for each page drawn, under cacheMutex
+    QFile      * diskCache;        // Mapped file holding the pages restored from disk
+
+    // Content bounding box of each page at 144 DPI, when margins are
+    // trimmed using vector data instead of pixels. Empty otherwise.
+    QVector<QRect> contentBoxes;
 
     void     setLoading(bool val);
     void      setLoaded(bool val);
@@ -69,14 +187,47 @@ class PDFFile : public QObject
 
     void load(QString filename, int atPage = 0);
 
+    static PDFDoc *        openDoc(const QString & fname);
+    RenderContext * acquireContext();
+    void            releaseContext(RenderContext * context);
+    void             clearContexts();
+    void              trimContexts(u32 maxCount);
+    u32           getContextsCount() { return contextsCount;  }
+    u32          getContextsReused() { return contextsReused; }
+
+    void insertTile(const TileKey & key, const QImage & image);
+    bool    getTile(const TileKey & key, QImage & image);
+    void clearTiles();
+
+    static TextPage * buildTextLayout(PDFDoc * doc, u32 page,
+                                      bool (* abortCheck)(void *) = nullptr, void * abortData = nullptr);
+    void insertTextLayout(u32 page, TextPage * text);
+    bool    hasTextLayout(u32 page);
+    bool          getText(u32 page, const QRectF & area, QString & text);
+    void clearTextLayouts();
+
+    void setVisible(u32 first, u32 last);
+    bool  pageReady(u32 page);
+    void metricsChanged(u32 page);
+    QList<u32> metricsChangesSince(u32 & position);
+    void        clearMetricsChanges();
+    void requestResolution(u32 page, float scale);
+    void requestTiles(const QList<TileKey> & keys);
+
   signals:
     void     fileIsLoading();
     void fileLoadCompleted();
     void       fileIsValid();
-    void pageLoadCompleted();
+    void        pagesReady(const QList<u32> & pages);
+    void    visibleChanged();
+    void resolutionRequested(u32 page, float scale);
+    void      tilesRequested(const QList<TileKey> & keys);
 
   public slots:
     void pageCompleted();
+
+  private slots:
+    void refreshPages();
 };
 
 #endif // PDFFILE_H
@@ -20,14 +20,38 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <GlobalParams.h>
 #include <SplashOutputDev.h>
 #include <splash/SplashBitmap.h>
+#include <BBoxOutputDev.h>
 #include <QDebug>
 
+#include <algorithm>
+#include <cmath>
+
 #include "pdfloader.h"
 #include "pdfpageworker.h"
-
-PDFLoader::PDFLoader(PDFFile & pdfFile) :
-  aborting(false),
-  pdfFile(pdfFile)
+#include "pagecodec.h"
+#include "diskcache.h"
+
+// Evicted pages this close to the visible ones are rendered again. Pages
+// this close are never evicted.
+#define RERENDER_DISTANCE 4
+
+PDFLoader::PDFLoader(const QString & fname, PDFFile & pdfFile) :
+  aborting(0),
+  filename(fname),
+  pdfFile(pdfFile),
+  inFlight(0),
+  remaining(0),
+  first(0),
+  last(0),
+  direction(0),
+  rebuild(true),
+  maxInFlight(1),
+  vectorTrim(preferences.vectorTrim),
+  pageCodec(preferences.pageCodec),
+  budget(preferences.cacheBudget * 1024LL * 1024LL),
+  diskCacheSize(preferences.diskCacheSize * 1024LL * 1024LL),
+  restored(0),
+  rendered(0)
 {
   if (!globalParams) {
     globalParams.reset(new GlobalParams());
@@ -35,95 +59,664 @@ PDFLoader::PDFLoader(PDFFile & pdfFile) :
   threadPool = QThreadPool::globalInstance();
 }
 
-static bool notdone(const bool arr[], const u32 num) {
-  u32 i;
-  for (i = 0; i <= num; i++) {
-    if (!arr[i]) return true;
+// Workers still in the pool queue are removed from it. Workers already
+// running will see the token and abort their rendering as soon as
+// poppler calls their abort check function.
+void PDFLoader::abort()
+{
+  QMutexLocker locker(&mutex);
+
+  aborting.storeRelaxed(1);
+
+  QList<PDFPageWorker *>::iterator it = workers.begin();
+  while (it != workers.end()) {
+    if (threadPool->tryTake(*it)) {
+      delete *it;
+      it = workers.erase(it);
+      inFlight -= 1;
+    }
+    else {
+      ++it;
+    }
+  }
+
+  condition.wakeAll();
+}
+
+void PDFLoader::refreshRequest()
+{
+  emit refresh();
+}
+
+// Called by the viewer (through PDFFile) each time the visible range of pages
+// is modified. The queue will be reordered before the next page is selected.
+void PDFLoader::visibleChanged()
+{
+  QMutexLocker locker(&mutex);
+
+  const u32 newFirst = pdfFile.firstVisible;
+  const u32 newLast  = pdfFile.lastVisible;
+
+  if ((newFirst == first) && (newLast == last)) return;
+
+  if      (newFirst > first) direction =  1;
+  else if (newFirst < first) direction = -1;
+
+  first   = newFirst;
+  last    = newLast;
+  rebuild = true;
+
+  dropResolutions();
+
+  // The text layouts of the new visible pages are built even once the
+  // whole document is rendered
+  condition.wakeAll();
+}
+
+// Called by a worker, in the worker thread, when its page is done.
+void PDFLoader::pageDone(PDFPageWorker * worker)
+{
+  QMutexLocker locker(&mutex);
+
+  workers.removeOne(worker);
+  inFlight -= 1;
+
+  if (worker->isTile()) {
+    tilesInFlight.remove(worker->getTile());
+    condition.wakeAll();
+    return;
+  }
+
+  if (worker->isText()) {
+    textInFlight.remove(worker->getPage());
+    condition.wakeAll();
+    return;
+  }
+
+  // The page may have been scrolled away while its sharper version was
+  // being rendered
+  const u32 page = worker->getPage();
+  if ((worker->getScale() > 1.0f) && ((page < first) || (page > last))) {
+    dropResolution(page);
+  }
+
+  if (worker->getScale() == 1.0f) {
+    rendered += 1;
+    if (budget > 0) evictPages();
+  }
+
+  condition.wakeAll();
+}
+
+// Visible pages come first. Then the pages are ordered by their distance
+// to the visible range, pages in the scrolling direction being favored:
+// a page behind is considered twice as far as a page ahead.
+u32 PDFLoader::priority(u32 page) const
+{
+  if ((page >= first) && (page <= last)) return 0;
+
+  if (page > last) {
+    const u32 distance = page - last;
+    return (direction < 0) ? 2 * distance : distance;
+  }
+  else {
+    const u32 distance = first - page;
+    return (direction < 0) ? distance : 2 * distance;
   }
+}
+
+bool PDFLoader::later(const QueuedPage & a, const QueuedPage & b)
+{
+  return (a.priority > b.priority) ||
+        ((a.priority == b.priority) && (a.page > b.page));
+}
+
+void PDFLoader::rebuildQueue()
+{
+  queue.clear();
+  previewQueue.clear();
+  for (u32 i = 0; i < pdfFile.pages; i++) {
+    if (!queued[i]) {
+      // Evicted pages are only rendered again when getting close
+      const u32 p = priority(i);
+      if ((pdfFile.cache[i].state == PS_EVICTED) && (p > RERENDER_DISTANCE)) continue;
+
+      queue.push_back({ p, i });
+      if (!previewed[i]) previewQueue.push_back({ p, i });
+    }
+  }
+  std::make_heap(queue.begin(), queue.end(), later);
+  std::make_heap(previewQueue.begin(), previewQueue.end(), later);
+
+  rebuild = false;
+}
+
+// Select the next page to be rendered. Must be called with the mutex locked.
+bool PDFLoader::nextPage(u32 & page, bool visibleOnly)
+{
+  while (!queue.empty()) {
+    if (visibleOnly && (queue.front().priority != 0)) return false;
+
+    std::pop_heap(queue.begin(), queue.end(), later);
+    const u32 candidate = queue.back().page;
+    queue.pop_back();
+
+    if (!queued[candidate]) {
+      QMutexLocker locker(&pdfFile.cacheMutex);
+      PageState & state = pdfFile.cache[candidate].state;
+
+      // Evicted pages were already counted when first rendered
+      if (state != PS_EVICTED) remaining -= 1;
+      state = PS_QUEUED;
+
+      queued[candidate] = true;
+      page = candidate;
+      return true;
+    }
+  }
+
   return false;
 }
 
-void PDFLoader::abort()
+// Select the next page of the preview pass. Pages already given to a
+// worker for their full rendering are skipped. Must be called with the
+// mutex locked.
+bool PDFLoader::nextPreview(u32 & page)
 {
-  aborting = true;
+  while (!previewQueue.empty()) {
+    std::pop_heap(previewQueue.begin(), previewQueue.end(), later);
+    const u32 candidate = previewQueue.back().page;
+    previewQueue.pop_back();
+
+    if (!queued[candidate] && !previewed[candidate]) {
+      previewed[candidate] = true;
+      page = candidate;
+      return true;
+    }
+  }
+
+  return false;
 }
 
-void PDFLoader::refreshRequest()
+// Select the next sharper version requested by the viewer. Requests for
+// pages that are no longer visible are dropped. Must be called with the
+// mutex locked.
+bool PDFLoader::nextRequest(u32 & page, float & scale)
 {
-  emit refresh();
+  while (!requests.isEmpty()) {
+    QMap<u32, float>::iterator it = requests.begin();
+    const u32   candidate = it.key();
+    const float wanted    = it.value();
+    requests.erase(it);
+
+    if ((candidate >= first) && (candidate <= last) && pdfFile.cache[candidate].isReady()) {
+      scales[candidate] = wanted;
+      if (!hiresPages.contains(candidate)) hiresPages.append(candidate);
+      page  = candidate;
+      scale = wanted;
+      return true;
+    }
+  }
+
+  return false;
 }
 
-void PDFLoader::run()
+bool PDFLoader::nextTile(TileKey & key)
 {
-  // Optional timing
+  while (!tileRequests.isEmpty()) {
+    const TileKey candidate = tileRequests.takeFirst();
+
+    if ((candidate.page >= first) && (candidate.page <= last) &&
+        pdfFile.cache[candidate.page].isReady() &&
+        !tilesInFlight.contains(candidate)) {
+      tilesInFlight.insert(candidate);
+      key = candidate;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Text layouts of the visible pages missing, for the text selection. With
+// many pages on screen, only the first ones are considered: the cache
+// must be able to keep them all. Must be called with the mutex locked.
+bool PDFLoader::nextText(u32 & page)
+{
+  const u32 end = qMin(last, first + TEXT_CACHE_PAGES / 2 - 1);
+
+  for (u32 candidate = first; (candidate <= end) && (candidate < pdfFile.pages); candidate++) {
+    if (!textInFlight.contains(candidate) && !pdfFile.hasTextLayout(candidate)) {
+      textInFlight.insert(candidate);
+      page = candidate;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Visible pages not rendered yet come first, then the visible tiles, the
+// sharper versions requested by the viewer and the text layouts of the
+// visible pages. A quick preview pass over the
+// whole document follows, so that the viewer knows the geometry of every
+// page and has something to show. Then the rest of the document is fully
+// rendered. Must be called with the mutex locked.
+PDFPageWorker * PDFLoader::nextWorker()
+{
+  u32     page;
+  float   scale = 1.0f;
+  TileKey key;
+
+  if (rebuild) rebuildQueue();
+
+  PDFPageWorker * pw;
+
+  if (nextPage(page, true)) {
+    pw = new PDFPageWorker(pdfFile, page, aborting);
+  }
+  else if (nextTile(key)) {
+    pw = new PDFPageWorker(pdfFile, key, aborting);
+  }
+  else if (nextRequest(page, scale)) {
+    pw = new PDFPageWorker(pdfFile, page, aborting, scale);
+  }
+  else if (nextText(page)) {
+    pw = new PDFPageWorker(pdfFile, page, aborting, TextLayoutJob());
+  }
+  else if (nextPreview(page)) {
+    pw = new PDFPageWorker(pdfFile, page, aborting, PREVIEW_SCALE);
+  }
+  else if (nextPage(page, false)) {
+    pw = new PDFPageWorker(pdfFile, page, aborting);
+  }
+  else {
+    return nullptr;
+  }
+
+  connect(pw, SIGNAL(              refresh()), this, SLOT(           refreshRequest()));
+  connect(pw, SIGNAL(done(PDFPageWorker *)), this, SLOT(pageDone(PDFPageWorker *)), Qt::DirectConnection);
+
+  return pw;
+}
+
+// Called by the viewer (through PDFFile) when a visible page is drawn at a
+// scale much larger than the one it was rendered at.
+void PDFLoader::requestResolution(u32 page, float scale)
+{
+  QMutexLocker locker(&mutex);
+
+  if ((page >= scales.size()) || (scales[page] == scale)) return;
+
+  requests.insert(page, scale);
+  condition.wakeAll();
+}
+
+// Called by the viewer (through PDFFile) after each repaint. The list
+// replaces the previous one: tiles scrolled away or at a previous zoom
+// factor are not rendered.
+void PDFLoader::requestTiles(const QList<TileKey> & keys)
+{
+  QMutexLocker locker(&mutex);
+
+  if (keys.isEmpty() && tileRequests.isEmpty()) return;
+
+  tileRequests = keys;
+  condition.wakeAll();
+}
+
+void PDFLoader::dropResolution(u32 page)
+{
+  pdfFile.cacheMutex.lock();
+  pdfFile.cache[page].hiresData.clear();
+  pdfFile.cache[page].hiresScale = 0.0f;
+  pdfFile.cacheMutex.unlock();
+
+  scales[page] = 0.0f;
+  hiresPages.removeOne(page);
+}
+
+// Sharper versions are only kept for the visible pages. Must be called
+// with the mutex locked.
+void PDFLoader::dropResolutions()
+{
+  QList<u32> pages = hiresPages;
+
+  for (u32 page : pages) {
+    if ((page < first) || (page > last)) dropResolution(page);
+  }
+}
+
+// Drop the compressed pages farthest from the visible ones, the least
+// recently drawn first among pages at the same distance, until the cache
+// is back under 90% of its budget. Their metrics and preview are kept:
+// the layout is unchanged and the preview is drawn until the page is
+// rendered again. Must be called with the mutex locked.
+void PDFLoader::evictPages()
+{
+  QMutexLocker locker(&pdfFile.cacheMutex);
+
+  if (pdfFile.cachedBytes <= budget) return;
+
+  // The last use is copied: the viewer keeps updating it while sorting
+  struct Candidate {
+    u32 priority;
+    u32 page;
+    u32 lastUsed;
+  };
+
+  std::vector<Candidate> candidates;
+  for (u32 i = 0; i < pdfFile.pages; i++) {
+    const u32 p = priority(i);
+    if ((p > RERENDER_DISTANCE) && pdfFile.cache[i].isReady()) {
+      candidates.push_back({ p, i, pdfFile.cache[i].lastUsed });
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate & a, const Candidate & b) {
+              if (a.priority != b.priority) return a.priority > b.priority;
+              return a.lastUsed < b.lastUsed;
+            });
+
+  const qint64 target  = budget - budget / 10;
+  u32          evicted = 0;
+
+  for (const Candidate & candidate : candidates) {
+    if (pdfFile.cachedBytes <= target) break;
+
+    CachedPage & cache = pdfFile.cache[candidate.page];
+
+    pdfFile.cachedBytes -= cache.data.size();
+    cache.data.clear();
+    cache.state = PS_EVICTED;
+
+    queued[candidate.page] = false;
+    evicted += 1;
+  }
+
+  if (details && (evicted > 0)) {
+    qInfo() << "Evicted" << evicted << "pages, cache size now" <<
+      (pdfFile.cachedBytes / 1024 / 1024.0f) << "mb" << Qt::endl;
+  }
+}
+
+// Parse the document. This is done in the loader thread as it may take
+// a while for big documents on slow storage. The viewer only gets access
+// to the document when the opened() signal is received.
+bool PDFLoader::openDocument()
+{
+  PDFDoc * pdfDoc = PDFFile::openDoc(filename);
+  if (!pdfDoc->isOk()) {
+    const int err = pdfDoc->getErrorCode();
+    QString msg = tr("Unknown.");
+
+    switch (err) {
+      case errOpenFile:
+      case errFileIO:
+        msg = tr("Couldn't open file.");
+      break;
+      case errBadCatalog:
+      case errDamaged:
+      case errPermission:
+        msg = tr("Damaged PDF file.");
+      break;
+    }
+
+    qCritical() << err << ", " << msg << Qt::endl;
+
+    delete pdfDoc;
+    return false;
+  }
+
+  const u32 pages = pdfDoc->getNumPages();
+
+  if (pages < 1) {
+    qCritical() << QString(tr("Couldn't open ")) << filename << QString(tr("perhaps it's corrupted?")) << Qt::endl;
+
+    delete pdfDoc;
+    return false;
+  }
+
+  CachedPage * cache = new CachedPage[pages]();
+
+  // The geometry of every page is taken from its crop box and rotation, at
+  // the 144 DPI rendering resolution, without rendering anything. The
+  // viewer layout is then exact from the start. Margins are unknown until
+  // the page is rendered and its content trimmed.
   struct timeval start, end;
   gettimeofday(&start, NULL);
 
-  u32 chunksize = QThread::idealThreadCount();
+  for (u32 i = 0; i < pages; i++) {
+    const int rotate = pdfDoc->getPageRotate(i + 1);
+    u32 w = pdfDoc->getPageCropWidth(i + 1)  * 2;
+    u32 h = pdfDoc->getPageCropHeight(i + 1) * 2;
+    if ((rotate == 90) || (rotate == 270)) std::swap(w, h);
 
-  if (chunksize < 4) chunksize = 4;
+    cache[i].w = w;
+    cache[i].h = h;
+  }
 
-  // qDebug() << "Chunk Size: " << chunksize;
-  // qDebug() << "Page count: " << pdfFile.pages;
+  gettimeofday(&end, NULL);
 
-  if (pdfFile.pages < chunksize) {
-    // First page (page 0) already done...
-    for (u32 i = 1; i < pdfFile.pages; i++) {
-      PDFPageWorker * pw = new PDFPageWorker(pdfFile, i);
-      connect(pw, SIGNAL(refresh()), this, SLOT(refreshRequest()));
-      threadPool->start(pw);
+  if (details) {
+    qInfo() << "Pages geometry retrieved in" << usecs(start, end) << "us" << Qt::endl;
+  }
+
+  pdfFile.contentBoxes.clear();
+  if (vectorTrim) findContentBoxes(pdfDoc, cache, pages);
+
+  // The selected codec may not be available in this build
+  pdfFile.codec = PageCodec::get(pageCodec);
+  if (pdfFile.codec == nullptr) pdfFile.codec = PageCodec::get(PCI_PNG);
+
+  pdfFile.pdf   = pdfDoc;
+  pdfFile.cache = cache;
+  pdfFile.maxW  = pdfFile.maxH = 0;
+  pdfFile.pages = pages;
+
+  return true;
+}
+
+// Compute the ink bounding box of every page from its content stream.
+// Nothing is rasterized. The margins are then known before any page is
+// rendered and the workers crop the pages with them instead of scanning
+// the pixels. Blank pages are not trimmed.
+void PDFLoader::findContentBoxes(PDFDoc * pdfDoc, CachedPage * cache, u32 pages)
+{
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  pdfFile.contentBoxes.resize(pages);
+
+  for (u32 i = 0; (i < pages) && !aborting.loadRelaxed(); i++) {
+    const s32 w = cache[i].w;
+    const s32 h = cache[i].h;
+
+    QRect box(0, 0, w, h);
+
+    BBoxOutputDev bbox;
+    pdfDoc->displayPage(&bbox, i + 1, 144, 144, 0, true, false, false);
+
+    if (bbox.getHasGraphics()) {
+      // The device space has its origin at the bottom left of the page
+      const s32 x1 = qBound(0, (s32) floor(bbox.getX1()),     w - 1);
+      const s32 x2 = qBound(0, (s32) ceil (bbox.getX2()),     w - 1);
+      const s32 y1 = qBound(0, (s32) floor(h - bbox.getY2()), h - 1);
+      const s32 y2 = qBound(0, (s32) ceil (h - bbox.getY1()), h - 1);
+
+      if ((x2 >= x1) && (y2 >= y1)) box.setCoords(x1, y1, x2, y2);
     }
-    threadPool->waitForDone(10000);
+
+    pdfFile.contentBoxes[i] = box;
+
+    cache[i].w      = box.width();
+    cache[i].h      = box.height();
+    cache[i].left   = box.left();
+    cache[i].right  = w - box.right() - 1;
+    cache[i].top    = box.top();
+    cache[i].bottom = h - box.bottom() - 1;
   }
-  else {
-    // With a lot of pages, the user may want to go far before things
-    // are fully loaded, say to page 500. Render in chunks and adapt.
 
-    u32 c;
-    const u32 chunks    = pdfFile.pages / chunksize;
-    const u32 remainder = pdfFile.pages % chunksize;
+  gettimeofday(&end, NULL);
+
+  if (details) {
+    qInfo() << "Content bounding boxes found in" << usecs(start, end) << "us" << Qt::endl;
+  }
+}
+
+// Get the pages rendered when the document was previously opened. Called
+// before any worker is started.
+void PDFLoader::restorePages()
+{
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  diskCacheKey = DiskCache::key(filename, vectorTrim);
 
-    bool done[chunks + 1];
-    std::fill(done, done+chunks+1, 0);
+  QFile * file = DiskCache::load(diskCacheKey, pdfFile.cache, pdfFile.pages);
+  if (file == nullptr) return;
 
-    while (notdone(done, chunks)) {
-      for (c = 0; c <= chunks; c++) {
+  pdfFile.diskCache = file;
+
+  for (u32 i = 0; i < pdfFile.pages; i++) {
+    if (pdfFile.cache[i].isReady()) {
+      pdfFile.cachedBytes += pdfFile.cache[i].data.size();
+      restored += 1;
+    }
+  }
 
-        if (aborting) return;
+  gettimeofday(&end, NULL);
 
-        // Did the user skip around (beyond title page) ?
-        const u32 first = __sync_fetch_and_add(&pdfFile.firstVisible, 0);
-        if (first > 0) {
-          const u32 tmp = first / chunksize;
-          if (tmp <= chunks && !done[tmp]) c = tmp;
-        }
+  if (details) {
+    qInfo() << "Restored" << restored << "pages from the disk cache in" << usecs(start, end) << "us" << Qt::endl;
+  }
+}
 
-        if (done[c]) continue;
+// Save the rendered pages for the next time the document is opened. The
+// workers may still be rendering sharper versions: the pages are taken
+// under the cache mutex, but written without it.
+void PDFLoader::savePages()
+{
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
 
-        u32 max = (c + 1) * chunksize;
-        if (c == chunks) max -= (chunksize - remainder);
+  if (diskCacheKey.isEmpty()) diskCacheKey = DiskCache::key(filename, vectorTrim);
 
-        // qDebug() << "Chunk " << c;
+  std::vector<CachedPage> pages(pdfFile.pages);
 
-        for (u32 i = (c == 0) ? 1 : c * chunksize; // Don't do page 0 again
-             i < max;
-             i++) {
-          PDFPageWorker * pw = new PDFPageWorker(pdfFile, i);
-          connect(pw, SIGNAL(refresh()), this, SLOT(refreshRequest()));
-          threadPool->start(pw);
-        }
+  pdfFile.cacheMutex.lock();
+  for (u32 i = 0; i < pdfFile.pages; i++) {
+    if (pdfFile.cache[i].isReady()) pages[i] = pdfFile.cache[i];
+  }
+  pdfFile.cacheMutex.unlock();
+
+  if (!DiskCache::save(diskCacheKey, pages.data(), pdfFile.pages)) {
+    qWarning() << "Unable to save the pages in the disk cache" << Qt::endl;
+    return;
+  }
+
+  DiskCache::cleanup(diskCacheSize);
+
+  gettimeofday(&end, NULL);
+
+  if (details) {
+    qInfo() << "Pages saved in the disk cache in" << usecs(start, end) << "us" << Qt::endl;
+  }
+}
+
+void PDFLoader::run()
+{
+  // Optional timing
+  struct timeval start;
+  gettimeofday(&start, NULL);
 
-        threadPool->waitForDone(10000);
-        done[c] = true;
-      }
+  if (!openDocument()) {
+    // Nothing more will come from this file
+    pdfFile.setLoaded(true);
+    return;
+  }
+
+  if (diskCacheSize > 0) restorePages();
+
+  // Never give more pages to the pool than it can process at once: the
+  // queue order is then still current when a thread becomes available
+  // and all threads are kept busy.
+  maxInFlight = qMax(threadPool->maxThreadCount(), 1);
+
+  mutex.lock();
+  queued.assign(pdfFile.pages, false);
+  previewed.assign(pdfFile.pages, false);
+  scales.assign(pdfFile.pages, 0.0f);
+  remaining = pdfFile.pages;
+  first     = pdfFile.firstVisible;
+  last      = pdfFile.lastVisible;
+  rebuild   = true;
+
+  // Pages read from the disk cache are not rendered
+  for (u32 i = 0; i < pdfFile.pages; i++) {
+    if (pdfFile.cache[i].isReady()) {
+      queued[i]  = true;
+      remaining -= 1;
+    }
+  }
+  if (budget > 0) evictPages();
+  mutex.unlock();
+
+  emit opened();
+
+  bool loaded = false;
+
+  // Once the whole document is rendered, the loader stays available for
+  // the viewer requests until the document is closed.
+  while (true) {
+    PDFPageWorker * pw = nullptr;
+
+    mutex.lock();
+    while (!aborting.loadRelaxed()) {
+      if (!loaded && (remaining == 0) && (inFlight == 0)) break;
+      if ((inFlight < maxInFlight) && ((pw = nextWorker()) != nullptr)) break;
+      condition.wait(&mutex);
+    }
+
+    if (pw != nullptr) {
+      // Started while the mutex is locked, so that abort() will always
+      // find it in the list
+      workers.append(pw);
+      inFlight += 1;
+      threadPool->start(pw);
+
+      mutex.unlock();
+      continue;
     }
+    mutex.unlock();
+
+    if (aborting.loadRelaxed()) break;
+
+    loaded = true;
+    documentLoaded(start);
   }
 
+  // Wait for the pages still being rendered. On abort, this is only
+  // the time required by poppler to notice it.
+  mutex.lock();
+  while (inFlight > 0) condition.wait(&mutex);
+  mutex.unlock();
+}
+
+// The whole document has been rendered
+void PDFLoader::documentLoaded(const timeval & start)
+{
+  struct timeval end;
+
+  // Pages may still be evicted or rendered again meanwhile
   u32 total = 0, totalcomp = 0;
+  pdfFile.cacheMutex.lock();
   for (u32 i = 0; i < pdfFile.pages; i++) {
     total += pdfFile.cache[i].uncompressed;
     totalcomp += pdfFile.cache[i].data.size();
   }
+  pdfFile.cacheMutex.unlock();
 
   pdfFile.totalSize = total;
   pdfFile.totalSizeCompressed = totalcomp;
@@ -149,8 +742,38 @@ void PDFLoader::run()
       "us (" <<
       (us / 1000000.0f) <<
       " s)" << Qt::endl;
+
+    // Use the --threads option to compare the scaling from 1 to N threads.
+    // The pages restored from the disk cache are not counted.
+    if (rendered > 0) {
+      qInfo() <<
+        "Rendered" <<
+        (rendered * 1000000.0f / us) <<
+        "pages/s using" <<
+        maxInFlight <<
+        "threads and" <<
+        pdfFile.getContextsCount() <<
+        "document instances" << Qt::endl;
+    }
+
+    // Pages rendered with an output device (and its font and glyph caches)
+    // already used for a previous page of this document. None is used when
+    // all the pages come from the disk cache.
+    const u32 contextsUsed = pdfFile.getContextsReused() + pdfFile.getContextsCount();
+    if (contextsUsed > 0) {
+      qInfo() <<
+        "Output device reuse rate" <<
+        (100.0f * pdfFile.getContextsReused() / contextsUsed) <<
+        "%" << Qt::endl;
+    }
+
+    qInfo() << "Pages compressed with" << pdfFile.codec->name() << Qt::endl;
   }
 
+  if (codecBench) PageCodec::printBenchmark();
+
+  if ((diskCacheSize > 0) && (restored < pdfFile.pages)) savePages();
+
   u32 maxW = 0, maxH = 0;
   for (u32 i = 0; i < pdfFile.pages; i++) {
     if (pdfFile.cache[i].w > maxW) {
@@ -164,6 +787,4 @@ void PDFLoader::run()
   pdfFile.maxH = maxH;
 
   pdfFile.setLoaded(true);
-
-  return;
 }
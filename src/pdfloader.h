@@ -23,30 +23,102 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <QObject>
 #include <QThread>
 #include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QList>
+#include <QMap>
+#include <QSet>
+
+#include <vector>
 
 #include "updf.h"
 #include "pdffile.h"
 
+class PDFPageWorker;
+
 class PDFLoader : public QThread
 {
     Q_OBJECT
 
   public:
-    PDFLoader(PDFFile & pdfFile);
+    PDFLoader(const QString & fname, PDFFile & pdfFile);
     void run() Q_DECL_OVERRIDE;
 
   signals:
     void loadCompleted();
     void       refresh();
+    void        opened();
 
   public slots:
     void          abort();
     void refreshRequest();
+    void visibleChanged();
+    void       pageDone(PDFPageWorker * worker);
+    void requestResolution(u32 page, float scale);
+    void      requestTiles(const QList<TileKey> & keys);
 
   private:
-    bool          aborting;
-    PDFFile     & pdfFile;
-    QThreadPool * threadPool;
+    // Render queue entry. The lower the priority value, the sooner the
+    // page will be given to a worker.
+    struct QueuedPage {
+      u32 priority;
+      u32 page;
+    };
+
+    QAtomicInt     aborting;          // Cancellation token shared with the workers
+    QString        filename;
+    PDFFile      & pdfFile;
+    QThreadPool  * threadPool;
+
+    QMutex         mutex;
+    QWaitCondition condition;
+
+    std::vector<QueuedPage> queue;    // Heap of pages still to be rendered
+    std::vector<bool>       queued;   // Pages already given to a worker
+    std::vector<QueuedPage> previewQueue; // Heap of pages still to be previewed
+    std::vector<bool>       previewed;    // Previews already given to a worker
+    QList<PDFPageWorker *>  workers;  // Workers started but not completed
+    u32            inFlight;          // Size of the workers list
+    u32            remaining;         // Pages not yet given to a worker
+    u32            first, last;       // Visible range used for priorities
+    s32            direction;         // Last scrolling direction (-1, 0, 1)
+    bool           rebuild;           // Visible range changed, queue is stale
+    u32            maxInFlight;
+    bool           vectorTrim;        // Margins from the content bounding boxes
+    int            pageCodec;
+    qint64         budget;            // Compressed pages memory, 0 if unlimited
+    qint64         diskCacheSize;     // Disk cache directory limit, 0 if disabled
+    QString        diskCacheKey;
+    u32            restored;          // Pages read from the disk cache
+    u32            rendered;          // Pages rendered by the workers, at 144 DPI
+
+    QMap<u32, float>        requests;   // Sharper versions asked by the viewer
+    std::vector<float>      scales;     // Sharper version scale given to a worker
+    QList<u32>              hiresPages; // Pages with a sharper version
+
+    QList<TileKey>          tileRequests;  // Visible tiles missing, in drawing order
+    QSet<TileKey>           tilesInFlight; // Tiles given to a worker
+
+    QSet<u32>               textInFlight;  // Text layouts given to a worker
+
+    static bool           later(const QueuedPage & a, const QueuedPage & b);
+    u32                priority(u32 page) const;
+    void           rebuildQueue();
+    bool               nextPage(u32 & page, bool visibleOnly);
+    bool            nextPreview(u32 & page);
+    bool            nextRequest(u32 & page, float & scale);
+    bool               nextTile(TileKey & key);
+    bool               nextText(u32 & page);
+    PDFPageWorker *  nextWorker();
+    void         dropResolution(u32 page);
+    void        dropResolutions();
+    void             evictPages();
+    bool           openDocument();
+    void           findContentBoxes(PDFDoc * pdfDoc, CachedPage * cache, u32 pages);
+    void           restorePages();
+    void              savePages();
+    void         documentLoaded(const timeval & start);
 };
 
 #endif // PDFLOADER_H
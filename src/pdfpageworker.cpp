@@ -19,145 +19,243 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <GlobalParams.h>
 #include <SplashOutputDev.h>
 #include <splash/SplashBitmap.h>
+#include <TextOutputDev.h>
 #include <QDebug>
 #include <QElapsedTimer>
-#include <QBuffer>
+#include <QMutexLocker>
+
+#include <cstring>
 
 #include "pdfpageworker.h"
+#include "pagecodec.h"
 
-PDFPageWorker::PDFPageWorker(PDFFile & file, const u32 pageNbr) :
+PDFPageWorker::PDFPageWorker(PDFFile & file, const u32 pageNbr, const QAtomicInt & cancelToken,
+                             const float renderScale) :
   pdfFile(file),
-  page(pageNbr)
+  page(pageNbr),
+  cancelled(cancelToken),
+  scale(renderScale),
+  tiled(false),
+  tile(),
+  text(false)
 {
 
 }
 
-#define METRICS 1
+PDFPageWorker::PDFPageWorker(PDFFile & file, const TileKey & tileKey, const QAtomicInt & cancelToken) :
+  pdfFile(file),
+  page(tileKey.page),
+  cancelled(cancelToken),
+  scale(tileKey.scale),
+  tiled(true),
+  tile(tileKey),
+  text(false)
+{
+
+}
 
-#if 0
+PDFPageWorker::PDFPageWorker(PDFFile & file, const u32 pageNbr, const QAtomicInt & cancelToken,
+                             TextLayoutJob) :
+  pdfFile(file),
+  page(pageNbr),
+  cancelled(cancelToken),
+  scale(1.0f),
+  tiled(false),
+  tile(),
+  text(true)
+{
+
+}
+
+// Called regularly by poppler while the page is being rendered
+bool PDFPageWorker::abortCheck(void * data)
+{
+  return ((const QAtomicInt *) data)->loadRelaxed() != 0;
+}
 
-// This version is a little bit faster (about 33% faster) than the original algo,
-// but maybe not good enough to be retained, considering the readability lost
-// for the developper and the amount of time spent to do the calculation that is
-// already minimal (~200us per page...) (GT)
+// Margin detection. The bitmap is scanned row by row, following the memory
+// layout: the first and last rows with some ink are found first, then each
+// row in between is only scanned from the edges up to the current left and
+// right limits. The row scanners test 8 (SSE2) or 16 (AVX2) pixels at a
+// time, the best version being selected at runtime. A pixel is white when
+// its three color components are 255, whatever the value of the fourth byte.
 //
-// May *not* work on a big endian architecture if not running under gnu linux or OSX.
-// It is also expected that the pixels will be stored at a 32 bit boundary address.
+// May *not* work on a big endian architecture.
 
-#if __gnu_linux__ || (__APPLE__ && __MACH__)
-  #include <endian.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define SIMD_MARGINS 1
+  #include <immintrin.h>
+#else
+  #define SIMD_MARGINS 0
 #endif
 
-static bool nonwhite(const u32 pixel)
+#define WHITE_MASK 0xFF000000
+
+// Return the index of the first non-white pixel in [from, to[, to if none
+static u32 firstInkScalar(const u32 * const row, u32 from, const u32 to)
 {
-  return (pixel & le32toh(0x00FFFFFF)) != le32toh(0x00FFFFFF);
+  for (; from < to; from++) {
+    if ((row[from] | WHITE_MASK) != 0xFFFFFFFF) return from;
+  }
+  return to;
 }
 
-static void getmargins(const u8 * const src, const u32 w, const u32 h,
-      const u32 rowsize,
-      u32 *minx, u32 *maxx,
-      u32 *miny, u32 *maxy)
+// Return the index of the last non-white pixel in [from, to[, to if none
+static u32 lastInkScalar(const u32 * const row, const u32 from, const u32 to)
 {
+  for (u32 i = to; i > from; i--) {
+    if ((row[i - 1] | WHITE_MASK) != 0xFFFFFFFF) return i - 1;
+  }
+  return to;
+}
 
-  #if METRICS
-    struct timeval start, end;
-    static bool firstPage = true;
+#if SIMD_MARGINS
 
-    if (firstPage) {
-      gettimeofday(&start, NULL);
-    }
-  #endif
+__attribute__((target("sse2")))
+static u32 firstInkSSE2(const u32 * const row, u32 from, const u32 to)
+{
+  const __m128i mask = _mm_set1_epi32(WHITE_MASK);
+  const __m128i ones = _mm_set1_epi32(-1);
+
+  for (; from + 8 <= to; from += 8) {
+    const __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *) (row + from    )), mask);
+    const __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *) (row + from + 4)), mask);
+    const __m128i c = _mm_and_si128(_mm_cmpeq_epi32(a, ones), _mm_cmpeq_epi32(b, ones));
+    if (_mm_movemask_epi8(c) != 0xFFFF) break;
+  }
+  return firstInkScalar(row, from, to);
+}
 
-  int i, j;
-  const u32 *pixel;
-  const u32 *pixel2;
-
-  bool found = false;
-  pixel2 = (const u32 *) src;
-  pixel = pixel2++;
-  for (i = 0; i < (int) w && !found; i++) {
-    for (j = 0; j < (int) h && !found; j++) {
-      if (nonwhite(*pixel)) {
-        found = true;
-        *minx = i;
-      }
-      else {
-        pixel += w;
-      }
-    }
-    pixel = pixel2++;
+__attribute__((target("sse2")))
+static u32 lastInkSSE2(const u32 * const row, const u32 from, u32 to)
+{
+  const __m128i mask = _mm_set1_epi32(WHITE_MASK);
+  const __m128i ones = _mm_set1_epi32(-1);
+  const u32     none = to;
+
+  for (; to >= from + 8; to -= 8) {
+    const __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *) (row + to - 8)), mask);
+    const __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *) (row + to - 4)), mask);
+    const __m128i c = _mm_and_si128(_mm_cmpeq_epi32(a, ones), _mm_cmpeq_epi32(b, ones));
+    if (_mm_movemask_epi8(c) != 0xFFFF) break;
   }
+  const u32 i = lastInkScalar(row, from, to);
+  return (i == to) ? none : i;
+}
 
-  found = false;
-  pixel = (const u32 *)(src) + *minx;
-  for (j = 0; j < (int) h && !found; j++) {
-    for (i = *minx; i < (int) w && !found; i++) {
-      if (nonwhite(*pixel++)) {
-        found = true;
-        *miny = j;
-      }
-    }
-    pixel += *minx;
+__attribute__((target("avx2")))
+static u32 firstInkAVX2(const u32 * const row, u32 from, const u32 to)
+{
+  const __m256i mask = _mm256_set1_epi32(WHITE_MASK);
+  const __m256i ones = _mm256_set1_epi32(-1);
+
+  for (; from + 16 <= to; from += 16) {
+    const __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (row + from    )), mask);
+    const __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (row + from + 8)), mask);
+    const __m256i c = _mm256_and_si256(_mm256_cmpeq_epi32(a, ones), _mm256_cmpeq_epi32(b, ones));
+    if ((u32) _mm256_movemask_epi8(c) != 0xFFFFFFFF) break;
   }
+  return firstInkScalar(row, from, to);
+}
 
-  const int startx = *minx, starty = *miny;
+__attribute__((target("avx2")))
+static u32 lastInkAVX2(const u32 * const row, const u32 from, u32 to)
+{
+  const __m256i mask = _mm256_set1_epi32(WHITE_MASK);
+  const __m256i ones = _mm256_set1_epi32(-1);
+  const u32     none = to;
+
+  for (; to >= from + 16; to -= 16) {
+    const __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (row + to - 16)), mask);
+    const __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (row + to -  8)), mask);
+    const __m256i c = _mm256_and_si256(_mm256_cmpeq_epi32(a, ones), _mm256_cmpeq_epi32(b, ones));
+    if ((u32) _mm256_movemask_epi8(c) != 0xFFFFFFFF) break;
+  }
+  const u32 i = lastInkScalar(row, from, to);
+  return (i == to) ? none : i;
+}
 
-  found = false;
-  pixel2 = (const u32 *)(src) + (w - 1 + starty * w);
-  pixel  = pixel2--;
+#endif
 
-  for (i = w - 1; i >= startx && !found; i--) {
-    for (j = starty; j < h && !found; j++) {
-      if (nonwhite(*pixel)) {
-        found = true;
-        *maxx = i;
-      }
-      else {
-        pixel += w;
-      }
-    }
-    pixel = pixel2--;
-  }
+struct InkScanner {
+  u32 (* first)(const u32 * const row, u32 from, const u32 to);
+  u32 (* last )(const u32 * const row, const u32 from, u32 to);
+  const char * name;
+};
 
-  found = false;
-  pixel = pixel2 = (const u32 *)(src) + ((h - 1) * w + startx);
-  for (j = h - 1; j >= starty && !found; j--) {
-    for (i = startx; i <= *maxx && !found; i++) {
-      if (nonwhite(*pixel++)) {
-        found = true;
-        *maxy = j;
-      }
-    }
-    pixel = (pixel2 -= w);
+static const InkScanner scalarScanner = { firstInkScalar, lastInkScalar, "scalar" };
+
+static const InkScanner & bestScanner()
+{
+  #if SIMD_MARGINS
+    static const InkScanner avx2 = { firstInkAVX2, lastInkAVX2, "AVX2" };
+    static const InkScanner sse2 = { firstInkSSE2, lastInkSSE2, "SSE2" };
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return avx2;
+    if (__builtin_cpu_supports("sse2")) return sse2;
+  #endif
+
+  return scalarScanner;
+}
+
+// For an empty page, all limits are 0.
+static void findmargins(
+        const InkScanner & scanner,
+        const u8  * const src,
+        const u32   w,
+        const u32   h,
+        const u32   rowsize,
+              u32 * minx,
+              u32 * maxx,
+              u32 * miny,
+              u32 * maxy)
+{
+  #define ROW(j) ((const u32 *) (src + (j) * rowsize))
+
+  u32 top, bottom, left = w, right = w;
+
+  for (top = 0; top < h; top++) {
+    left = scanner.first(ROW(top), 0, w);
+    if (left < w) break;
   }
 
-  #if METRICS
-    if (firstPage) {
-      firstPage = false;
+  if (top == h) {
+    *minx = *maxx = *miny = *maxy = 0;
+    return;
+  }
 
-      gettimeofday(&end, NULL);
-      const u32 us = usecs(start, end);
+  right = scanner.last(ROW(top), left, w);
 
-      qInfo() <<
-        "Processing the first page took" <<
-        us <<
-        "us (" <<
-        (us / 1000000.0f) <<
-        " s)" << endl;
+  for (bottom = h - 1; bottom > top; bottom--) {
+    const u32 i = scanner.first(ROW(bottom), 0, w);
+    if (i < w) {
+      left  = qMin(left,  i);
+      right = qMax(right, scanner.last(ROW(bottom), i, w));
+      break;
     }
-  #endif
-}
+  }
 
-#else
+  // Only the parts of the rows outside of the current limits are scanned
+  for (u32 j = top + 1; j < bottom; j++) {
+    const u32 * const row = ROW(j);
 
-// This is the original algorithm from Lauri Kasanen (GT)
+    if (left > 0) {
+      const u32 i = scanner.first(row, 0, left);
+      if (i < left) left = i;
+    }
+    if (right < w - 1) {
+      const u32 i = scanner.last(row, right + 1, w);
+      if (i < w) right = i;
+    }
+  }
 
-static bool nonwhite(const u8 * const pixel)
-{
-  return
-    pixel[0] != 255 ||
-    pixel[1] != 255 ||
-    pixel[2] != 255;
+  #undef ROW
+
+  *minx = left;
+  *maxx = right;
+  *miny = top;
+  *maxy = bottom;
 }
 
 static void getmargins(
@@ -171,89 +269,145 @@ static void getmargins(
               u32 * maxy,
         int pageNbr)
 {
-  #if METRICS
+  static const InkScanner & scanner   = bestScanner();
+  static QAtomicInt          firstPage(1);
+
+  // Compare with the scalar version on the first page. Several workers
+  // may get there at once: only one of them does it.
+  if (details && firstPage.testAndSetRelaxed(1, 0)) {
     struct timeval start, end;
-    static bool firstPage = true;
+    u32 sminx, smaxx, sminy, smaxy;
 
-    if (firstPage) {
-      gettimeofday(&start, NULL);
-    }
-  #endif
+    gettimeofday(&start, NULL);
+    findmargins(scalarScanner, src, w, h, rowsize, &sminx, &smaxx, &sminy, &smaxy);
+    gettimeofday(&end, NULL);
+    const u32 scalarUs = usecs(start, end);
 
-  u32 i, j;
+    gettimeofday(&start, NULL);
+    findmargins(scanner, src, w, h, rowsize, minx, maxx, miny, maxy);
+    gettimeofday(&end, NULL);
+    const u32 us = usecs(start, end);
 
-  bool found = false;
-  for (i = 0; i < w && !found; i++) {
-    for (j = 0; j < h && !found; j++) {
-      const u8 * const pixel = src + (j * rowsize) + (i * 4);
-      if (nonwhite(pixel)) {
-        // if (pageNbr == 1) qDebug() << "Min x at " << j;
-        found = true;
-        *minx = i;
-      }
+    qInfo() <<
+      "Margins of page" << pageNbr << "(" << w << "x" << h << ") found in" <<
+      us << "us using" << scanner.name << "," <<
+      scalarUs << "us using" << scalarScanner.name << Qt::endl;
+
+    if ((sminx != *minx) || (smaxx != *maxx) || (sminy != *miny) || (smaxy != *maxy)) {
+      qWarning() << "Margins scanners mismatch on page" << pageNbr << Qt::endl;
     }
+    return;
   }
 
-  found = false;
-  for (j = 0; j < h && !found; j++) {
-    for (i = *minx; i < w && !found; i++) {
-      const u8 * const pixel = src + (j * rowsize) + (i * 4);
-      if (nonwhite(pixel)) {
-        // if (pageNbr == 1) qDebug() << "Min y at " << i;
-        found = true;
-        *miny = j;
+  findmargins(scanner, src, w, h, rowsize, minx, maxx, miny, maxy);
+}
+
+// Find the smallest format able to keep a portion of the bitmap without
+// loss: 1 bit per pixel if only black and white are used, 8 bits if all
+// pixels are gray, 32 bits otherwise. Most sheet music and scanned text
+// pages are at least gray.
+static QImage::Format pixelsFormat(
+        const u8 * const src,
+        const u32        rowsize,
+        const u32        x,
+        const u32        y,
+        const u32        w,
+        const u32        h)
+{
+  bool bilevel = true;
+
+  for (u32 j = 0; j < h; j++) {
+    const u32 * pixel = (const u32 *) (src + (y + j) * rowsize) + x;
+
+    for (u32 i = 0; i < w; i++, pixel++) {
+      // Same value for the three color components
+      if (((*pixel ^ (*pixel >> 8)) & 0xFFFF) != 0) return QImage::Format_RGB32;
+
+      if (bilevel) {
+        const u8 value = *pixel & 0xFF;
+        bilevel = (value == 0) || (value == 255);
       }
     }
   }
 
-  const u32 startx = *minx, starty = *miny;
+  return bilevel ? QImage::Format_Mono : QImage::Format_Grayscale8;
+}
 
-  found = false;
-  for (i = w - 1; i > startx && !found; i--) {
-    for (j = h - 1; j > starty && !found; j--) {
-      const u8 * const pixel = src + (j * rowsize) + (i * 4);
-      if (nonwhite(pixel)) {
-        // if (pageNbr == 1) qDebug() << "Max x at " << j;
-        found = true;
-        *maxx = i;
-      }
+// Copy a portion of the bitmap in the smallest format without loss. The
+// pixels are expanded back to 32 bits when converted to a QPixmap.
+static QImage copyPixels(
+        const u8 * const src,
+        const u32        rowsize,
+        const u32        x,
+        const u32        y,
+        const u32        w,
+        const u32        h)
+{
+  const QImage::Format format = pixelsFormat(src, rowsize, x, y, w, h);
+
+  QImage img(w, h, format);
+
+  if (format == QImage::Format_RGB32) {
+    for (u32 j = 0; j < h; j++) {
+      memcpy(img.scanLine(j), src + (y + j) * rowsize + x * 4, w * 4);
     }
   }
-
-  found = false;
-  for (j = h - 1; j > starty && !found; j--) {
-    for (i = *maxx; i > startx && !found; i--) {
-      const u8 * const pixel = src + (j * rowsize) + (i * 4);
-      if (nonwhite(pixel)) {
-        // if (pageNbr == 1) qDebug() << "Max y at " << i;
-        found = true;
-        *maxy = j;
+  else if (format == QImage::Format_Grayscale8) {
+    // The scanlines are padded to 32 bits. The padding is compressed with
+    // the pixels: cleared, so that the result only depends on the page.
+    const u32 padding = img.bytesPerLine() - w;
+
+    for (u32 j = 0; j < h; j++) {
+      const u32 * pixel = (const u32 *) (src + (y + j) * rowsize) + x;
+      u8        * dst   = img.scanLine(j);
+      for (u32 i = 0; i < w; i++) dst[i] = pixel[i] & 0xFF;
+      if (padding > 0) memset(dst + w, 0, padding);
+    }
+  }
+  else {
+    img.setColorTable(PageCodec::monoColorTable());
+    img.fill(0);
+
+    // Most significant bit first, white pixels set
+    for (u32 j = 0; j < h; j++) {
+      const u32 * pixel = (const u32 *) (src + (y + j) * rowsize) + x;
+      u8        * dst   = img.scanLine(j);
+      for (u32 i = 0; i < w; i++) {
+        if (pixel[i] & 0xFF) dst[i >> 3] |= 0x80 >> (i & 7);
       }
     }
   }
 
-  #if METRICS
-    if (firstPage) {
-      firstPage = false;
+  return img;
+}
 
-      gettimeofday(&end, NULL);
-      const u32 us = usecs(start, end);
+// Copy a portion of the bitmap and compress it. Return the size of the
+// uncompressed copy.
+static u32 compress(
+        SplashBitmap const & bm,
+        const u32            x,
+        const u32            y,
+        const u32            w,
+        const u32            h,
+        const PageCodec    * codec,
+        QByteArray         & data)
+{
+  const QImage img = copyPixels(bm.getDataPtr(), bm.getRowSize(), x, y, w, h);
 
-      qInfo() <<
-        "Processing the first page took" <<
-        us <<
-        "us (" <<
-        (us / 1000000.0f) <<
-        " s)" << Qt::endl;
-    }
-  #endif
-}
+  // Trimmed copy done, compress it
 
-#endif
+  codec->encode(img, data);
+
+  if (codecBench) PageCodec::benchmark(img);
 
-#undef METRICS
+  return img.sizeInBytes();
+}
 
-void store(SplashBitmap const & bm, CachedPage & cache, int pageNbr)
+// When box is not null, the page is cropped to the content bounding box
+// (at 144 DPI, scaled to the bitmap resolution) instead of being trimmed
+// from its pixels.
+void store(SplashBitmap const & bm, CachedPage & cache, const PageCodec * codec, int pageNbr,
+           const QRect * box = nullptr, const float scale = 1.0f)
 {
 //  const u32 w          = pg.width();
 //  const u32 h          = pg.height();
@@ -271,7 +425,15 @@ void store(SplashBitmap const & bm, CachedPage & cache, int pageNbr)
       maxy = 0;
 
   // Trim margins
-  getmargins(src, w, h, rowsize, &minx, &maxx, &miny, &maxy, pageNbr);
+  if (box != nullptr) {
+    minx = qMin<u32>(box->left()   * scale, w - 1);
+    miny = qMin<u32>(box->top()    * scale, h - 1);
+    maxx = qBound<u32>(minx, box->right()  * scale, w - 1);
+    maxy = qBound<u32>(miny, box->bottom() * scale, h - 1);
+  }
+  else {
+    getmargins(src, w, h, rowsize, &minx, &maxx, &miny, &maxy, pageNbr);
+  }
 
   const u32 trimw = maxx - minx + 1;
   const u32 trimh = maxy - miny + 1;
@@ -281,26 +443,13 @@ void store(SplashBitmap const & bm, CachedPage & cache, int pageNbr)
 //    qDebug() << "First pixel" << src[0] << src[1] << src[2] << src[3];
 //  }
 
-  u8 * const trimmed = (u8 *) xcalloc(trimw * trimh * 4, 1);
-  for (u32 j = miny; j <= maxy; j++) {
-    const u32 destj = j - miny;
-    memcpy(trimmed + destj * trimw * 4, src + j * rowsize + minx * 4, trimw * 4);
-  }
-
-  // Trimmed copy done, compress it
-
-  QImage img(trimmed, trimw, trimh, QImage::Format_RGB32);
-
-  QBuffer buf(&cache.data);
-  buf.open(QIODevice::WriteOnly);
-  img.save(&buf, "PNG", 50);
-  buf.close();
+  const u32 size = compress(bm, minx, miny, trimw, trimh, codec, cache.data);
 
   qDebug() << "Page " << pageNbr << " size: " << cache.data.size() / 1024.0 << "KB";
 
   // Store
 
-  cache.uncompressed = trimw * trimh * 4;
+  cache.uncompressed = size;
   cache.w            = trimw;
   cache.h            = trimh;
   cache.left         = minx;
@@ -309,19 +458,171 @@ void store(SplashBitmap const & bm, CachedPage & cache, int pageNbr)
   cache.bottom       = h - maxy;
   //cache.size         = tmp.size();
   //cache.data         = dst;
+}
+
+// Store a sharper version of an already rendered page. The trimmed area
+// is the same as the one found at 144 DPI.
+static void storeResolution(SplashBitmap const & bm, PDFFile & pdfFile, u32 page, float scale)
+{
+  CachedPage & cache = pdfFile.cache[page];
 
-  free(trimmed);
+  const u32 x = qMin<u32>(cache.left * scale, bm.getWidth()  - 1);
+  const u32 y = qMin<u32>(cache.top  * scale, bm.getHeight() - 1);
+  const u32 w = qMin<u32>(cache.w    * scale, bm.getWidth()  - x);
+  const u32 h = qMin<u32>(cache.h    * scale, bm.getHeight() - y);
+
+  QByteArray data;
+  compress(bm, x, y, w, h, pdfFile.codec, data);
+
+  QMutexLocker locker(&pdfFile.cacheMutex);
+
+  cache.hiresData  = data;
+  cache.hiresScale = scale;
+}
+
+// Store the preview of a page. Its metrics, scaled to the 144 DPI
+// resolution, are used by the viewer until the page is fully rendered.
+static void storePreview(SplashBitmap const & bm, PDFFile & pdfFile, u32 page)
+{
+  CachedPage preview;
+
+  store(bm, preview, pdfFile.codec, page, pdfFile.contentBoxes.isEmpty() ? nullptr : &pdfFile.contentBoxes.at(page),
+        PREVIEW_SCALE);
+
+  const float factor = 1.0f / PREVIEW_SCALE;
+
+  QMutexLocker locker(&pdfFile.cacheMutex);
+
+  CachedPage & cache = pdfFile.cache[page];
+
+  // Metrics from the full rendering or the content bounding box are
+  // already exact. A page evicted from the cache keeps them.
+  if (!cache.rendered && pdfFile.contentBoxes.isEmpty()) {
+    cache.w          = preview.w      * factor;
+    cache.h          = preview.h      * factor;
+    cache.left       = preview.left   * factor;
+    cache.right      = preview.right  * factor;
+    cache.top        = preview.top    * factor;
+    cache.bottom     = preview.bottom * factor;
+  }
+  cache.previewData  = preview.data;
+
+  // The page gets its metrics, the viewer layout may change
+  if (!cache.rendered) pdfFile.metricsChanged(page);
+
+  __sync_bool_compare_and_swap(&cache.previewReady, 0, 1);
+}
+
+// Render a single tile of the page. Tiles are positioned in the whole
+// page (margins included) rendered at the tile scale. The ones at the
+// right and bottom edges are smaller.
+void PDFPageWorker::renderTile(RenderContext * context)
+{
+  const CachedPage & cache = pdfFile.cache[page];
+
+  const s32 pageW = (cache.left + cache.w + cache.right ) * scale;
+  const s32 pageH = (cache.top  + cache.h + cache.bottom) * scale;
+  const s32 x     = tile.x * TILE_SIZE;
+  const s32 y     = tile.y * TILE_SIZE;
+  const s32 w     = qMin(TILE_SIZE, pageW - x);
+  const s32 h     = qMin(TILE_SIZE, pageH - y);
+
+  if ((w <= 0) || (h <= 0)) {
+    pdfFile.releaseContext(context);
+    return;
+  }
+
+  const double dpi = 144 * scale;
+
+  context->doc->displayPageSlice(context->splash, page + 1, dpi, dpi, 0, true, false, false,
+                                 x, y, w, h, abortCheck, (void *) &cancelled);
+
+  SplashBitmap * const bm = context->splash->takeBitmap();
+
+  pdfFile.releaseContext(context);
+
+  if (cancelled.loadRelaxed()) {
+    delete bm;
+    return;
+  }
+
+  pdfFile.insertTile(tile, copyPixels(bm->getDataPtr(), bm->getRowSize(),
+                                     0, 0, bm->getWidth(), bm->getHeight()));
+
+  delete bm;
+
+  const u32 first = __sync_fetch_and_add(&pdfFile.firstVisible, 0);
+  const u32 last  = __sync_fetch_and_add(&pdfFile.lastVisible,  0);
+  if ((page >= first) && (page <= last) && pdfFile.pageReady(page)) {
+    emit refresh();
+  }
+}
+
+// Build the text layout of the page, kept by the file for the text
+// selection. Nothing is rendered.
+void PDFPageWorker::buildText(RenderContext * context)
+{
+  TextPage * const layout = PDFFile::buildTextLayout(context->doc, page, abortCheck, (void *) &cancelled);
+
+  pdfFile.releaseContext(context);
+
+  if (cancelled.loadRelaxed()) {
+    layout->decRefCnt();
+    return;
+  }
+
+  pdfFile.insertTextLayout(page, layout);
 }
 
 void PDFPageWorker::run()
 {
-  SplashColor       white  = { 255, 255, 255 };
-  SplashOutputDev * splash = new SplashOutputDev(splashModeXBGR8, 4, false, white);
-  splash->startDoc(pdfFile.pdf);
+  // Still queued when the document was closed: nothing to do
+  if (cancelled.loadRelaxed()) {
+    emit done(this);
+    return;
+  }
+
+  // Our own instance of the document and output device, not shared
+  // with other threads
+  RenderContext * const context = pdfFile.acquireContext();
+  if (context == nullptr) {
+    emit done(this);
+    return;
+  }
 
-  pdfFile.pdf->displayPage(splash, page + 1, 144, 144, 0, true, false, false);
+  if (tiled) {
+    renderTile(context);
+    emit done(this);
+    return;
+  }
+
+  if (text) {
+    buildText(context);
+    emit done(this);
+    return;
+  }
+
+  const double dpi = 144 * scale;
+
+  if (scale == 1.0f) {
+    pdfFile.cacheMutex.lock();
+    pdfFile.cache[page].state = PS_RENDERING;
+    pdfFile.cacheMutex.unlock();
+  }
 
-  SplashBitmap * const bm = splash->takeBitmap();
+  context->doc->displayPage(context->splash, page + 1, dpi, dpi, 0, true, false, false,
+                            abortCheck, (void *) &cancelled);
+
+  SplashBitmap * const bm = context->splash->takeBitmap();
+
+  pdfFile.releaseContext(context);
+
+  // Rendering aborted: the page content is incomplete
+  if (cancelled.loadRelaxed()) {
+    delete bm;
+    emit done(this);
+    return;
+  }
 
 //  QSize size = pdfFile.pdf->pageSize(page).toSize();
 //  size.setWidth(size.width() * 2);
@@ -329,10 +630,39 @@ void PDFPageWorker::run()
 //  QImage pg = pdfFile.pdf->render(page, size);
 //  store(pg, pdfFile.cache[page], page);
 
-  store(*bm, pdfFile.cache[page], page);
+  if (scale == PREVIEW_SCALE) {
+    storePreview(*bm, pdfFile, page);
+  }
+  else if (scale != 1.0f) {
+    storeResolution(*bm, pdfFile, page, scale);
+  }
+  else {
+    CachedPage result;
+
+    store(*bm, result, pdfFile.codec, page, pdfFile.contentBoxes.isEmpty() ? nullptr : &pdfFile.contentBoxes.at(page));
+
+    // The preview pass may be updating the metrics of the same page
+    QMutexLocker locker(&pdfFile.cacheMutex);
+
+    CachedPage & cache = pdfFile.cache[page];
+
+    if (!cache.rendered) pdfFile.metricsChanged(page);
+
+    cache.data         = result.data;
+    cache.uncompressed = result.uncompressed;
+    cache.w            = result.w;
+    cache.h            = result.h;
+    cache.left         = result.left;
+    cache.right        = result.right;
+    cache.top          = result.top;
+    cache.bottom       = result.bottom;
+    cache.state        = PS_READY;
+    cache.rendered     = true;
+
+    pdfFile.cachedBytes += cache.data.size();
+  }
 
   delete bm;
-  delete splash;
 
 //  qDebug() << "Page "         << page
 //           << ", Width "      << c.w
@@ -344,12 +674,13 @@ void PDFPageWorker::run()
 //           << ", Size "       << c.size
 //           << ", Uncompress " << c.uncompressed;
 
-  __sync_bool_compare_and_swap(&pdfFile.cache[page].ready, 0, 1);
-
-  // If this page was visible, tell the app to refresh
+  // If this page was visible, tell the app to refresh. Pages rendered at
+  // about the same time are refreshed together.
   const u32 first = __sync_fetch_and_add(&pdfFile.firstVisible, 0);
   const u32 last  = __sync_fetch_and_add(&pdfFile.lastVisible,  0);
-  if (page >= first && page <= last) {
+  if ((page >= first) && (page <= last) && pdfFile.pageReady(page)) {
     emit refresh();
   }
+
+  emit done(this);
 }
@@ -19,24 +19,49 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <QObject>
 #include <QRunnable>
+#include <QAtomicInt>
 
 #include "updf.h"
 #include "pdffile.h"
 
+// Selects the constructor of a worker only building the text layout of
+// a page. A distinct type, so that no scale can be taken for it.
+struct TextLayoutJob {};
+
 class PDFPageWorker : public QObject, public QRunnable
 {
     Q_OBJECT
 
   public:
-    PDFPageWorker(PDFFile & file, const u32 pageNbr);
+    PDFPageWorker(PDFFile & file, const u32 pageNbr, const QAtomicInt & cancelToken,
+                  const float renderScale = 1.0f);
+    PDFPageWorker(PDFFile & file, const TileKey & tileKey, const QAtomicInt & cancelToken);
+    PDFPageWorker(PDFFile & file, const u32 pageNbr, const QAtomicInt & cancelToken,
+                  TextLayoutJob);
     void run();
 
+    u32            getPage()  const { return page;  }
+    float         getScale()  const { return scale; }
+    bool            isTile()  const { return tiled; }
+    bool            isText()  const { return text;  }
+    const TileKey & getTile() const { return tile;  }
+
   private:
-    PDFFile & pdfFile;
-    u32 page;
+    PDFFile          & pdfFile;
+    u32                page;
+    const QAtomicInt & cancelled; // Set by the loader when the document is closed
+    float              scale;     // Relative to 144 DPI. Not 1.0 for a sharper version
+    bool               tiled;     // Only render a tile of the page
+    TileKey            tile;
+    bool               text;      // Only build the text layout of the page
+
+    static bool abortCheck(void * data);
+    void        renderTile(RenderContext * context);
+    void         buildText(RenderContext * context);
 
   signals:
     void refresh();
+    void    done(PDFPageWorker * worker);
 };
 
 #endif // PDFPAGEWORKER_H
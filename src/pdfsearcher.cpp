@@ -0,0 +1,206 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <TextOutputDev.h>
+#include <QThreadPool>
+#include <QMutexLocker>
+
+#include "pdfsearcher.h"
+
+// Lower than the rendering workers: a search never delays the pages on
+// screen
+#define SEARCH_PRIORITY -1
+
+SearchJob::SearchJob(PDFSearcher & owner, PDFFile & file, const u32 pageNbr,
+                     const QString & searchText, const int searchGeneration) :
+  searcher(owner),
+  pdfFile(file),
+  page(pageNbr),
+  text(searchText),
+  generation(searchGeneration)
+{
+
+}
+
+// Called regularly by poppler while the page is being interpreted
+bool SearchJob::abortCheck(void * data)
+{
+  const SearchJob * job = (const SearchJob *) data;
+
+  return job->searcher.generation.loadRelaxed() != job->generation;
+}
+
+void SearchJob::run()
+{
+  searcher.mutex.lock();
+  searcher.pending.removeOne(this);
+  searcher.mutex.unlock();
+
+  QList<QRectF> boxes;
+
+  // Our own instance of the document, as for the rendering
+  RenderContext * const context = abortCheck(this) ? nullptr : pdfFile.acquireContext();
+
+  if (context != nullptr) {
+    TextPage * const layout = PDFFile::buildTextLayout(context->doc, page, abortCheck, this);
+
+    pdfFile.releaseContext(context);
+
+    const QList<uint> unicode = text.toUcs4();
+    double xMin = 0.0, yMin = 0.0, xMax = 0.0, yMax = 0.0;
+
+    // Each call continues after the previous hit. Case insensitive.
+    while (!abortCheck(this) &&
+           layout->findText(unicode.constData(), unicode.size(),
+                            false, true, true, false, false, false, false, false,
+                            &xMin, &yMin, &xMax, &yMax)) {
+      boxes.append(QRectF(QPointF(xMin, yMin), QPointF(xMax, yMax)));
+    }
+
+    layout->decRefCnt();
+  }
+
+  emit searched(page, generation, boxes);
+
+  searcher.jobDone();
+}
+
+PDFSearcher::PDFSearcher(QObject * parent) : QObject(parent),
+  pdfFile(nullptr),
+  generation(0),
+  next(0),
+  inFlight(0),
+  maxInFlight(1),
+  searched(0),
+  running(0)
+{
+  // Half of the pool at most: the others stay available for the pages
+  // scrolled to while searching
+  maxInFlight = qMax(QThreadPool::globalInstance()->maxThreadCount() / 2, 1);
+}
+
+PDFSearcher::~PDFSearcher()
+{
+  stop();
+}
+
+// The visible pages are searched first, then alternately the pages after
+// and before them, moving away from the visible ones.
+void PDFSearcher::start(PDFFile * file, const QString & searchText, u32 first, u32 last)
+{
+  stop();
+
+  pdfFile = file;
+  text    = searchText;
+
+  if (text.isEmpty() || (pdfFile == nullptr) || !pdfFile->isValid() || (pdfFile->pages == 0)) return;
+
+  last  = qMin(last, pdfFile->pages - 1);
+  first = qMin(first, last);
+
+  order.reserve(pdfFile->pages);
+
+  for (u32 page = first; page <= last; page++) order.append(page);
+
+  for (u32 dist = 1; (dist <= first) || (last + dist < pdfFile->pages); dist++) {
+    if (last + dist < pdfFile->pages) order.append(last + dist);
+    if (dist <= first)                order.append(first - dist);
+  }
+
+  startJobs();
+}
+
+// Jobs still in the pool queue are removed from it. The running ones see
+// the new generation and abort as soon as poppler calls their abort check
+// function. Waits for them: the file may be released afterward.
+void PDFSearcher::stop()
+{
+  const bool wasSearching = inFlight > 0;
+
+  generation.fetchAndAddRelaxed(1);
+
+  order.clear();
+  next     = 0;
+  inFlight = 0;
+  searched = 0;
+
+  QMutexLocker locker(&mutex);
+
+  for (SearchJob * job : pending) {
+    if (QThreadPool::globalInstance()->tryTake(job)) {
+      delete job;
+      running -= 1;
+    }
+  }
+  pending.clear();
+
+  while (running > 0) condition.wait(&mutex);
+
+  if (wasSearching) releaseContexts();
+}
+
+// The search jobs run next to the rendering workers, each with its own
+// context. The ones above a context per pool thread are freed once the
+// search is over.
+void PDFSearcher::releaseContexts()
+{
+  if (pdfFile != nullptr) pdfFile->trimContexts(QThreadPool::globalInstance()->maxThreadCount());
+}
+
+void PDFSearcher::startJobs()
+{
+  while ((inFlight < maxInFlight) && (next < order.size())) {
+    SearchJob * job = new SearchJob(*this, *pdfFile, order[next++], text, generation.loadRelaxed());
+
+    connect(job, &SearchJob::searched, this, &PDFSearcher::pageSearched);
+
+    // In the list before being started, so that stop() will always find it
+    mutex.lock();
+    pending.append(job);
+    running += 1;
+    QThreadPool::globalInstance()->start(job, SEARCH_PRIORITY);
+    mutex.unlock();
+
+    inFlight += 1;
+  }
+}
+
+// Called by a job, in its thread, once it won't use the file anymore
+void PDFSearcher::jobDone()
+{
+  QMutexLocker locker(&mutex);
+
+  running -= 1;
+  condition.wakeAll();
+}
+
+// Results of a previous search are ignored
+void PDFSearcher::pageSearched(int page, int gen, QList<QRectF> boxes)
+{
+  if (gen != generation.loadRelaxed()) return;
+
+  inFlight -= 1;
+  searched += 1;
+
+  if (!boxes.isEmpty()) emit hitsFound(page, boxes);
+
+  startJobs();
+
+  if (inFlight == 0) {
+    releaseContexts();
+    emit finished();
+  }
+}
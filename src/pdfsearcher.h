@@ -0,0 +1,109 @@
+/*
+Copyright (C) 2017, 2020 Guy Turcotte
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PDFSEARCHER_H
+#define PDFSEARCHER_H
+
+#include <QObject>
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QRectF>
+#include <QString>
+#include <QVector>
+
+#include "updf.h"
+#include "pdffile.h"
+
+class PDFSearcher;
+
+// Search one page for all the occurrences of the text. The boxes are in
+// page coordinates at 144 DPI, as the cached pages.
+class SearchJob : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+  public:
+    SearchJob(PDFSearcher & owner, PDFFile & file, const u32 pageNbr,
+              const QString & searchText, const int searchGeneration);
+    void run() Q_DECL_OVERRIDE;
+
+  private:
+    PDFSearcher & searcher;
+    PDFFile     & pdfFile;
+    u32           page;
+    QString       text;
+    int           generation;  // Aborted once the searcher starts another search
+
+    static bool abortCheck(void * data);
+
+  signals:
+    void searched(int page, int generation, QList<QRectF> boxes);
+};
+
+// Full text search of a document. The pages are searched in parallel in
+// the render pool, with a lower priority than the rendering workers,
+// starting from the visible pages and expanding outward. The hits of each
+// page are signaled as soon as it is searched. A new search cancels the
+// previous one.
+class PDFSearcher : public QObject
+{
+    Q_OBJECT
+
+  public:
+    explicit PDFSearcher(QObject * parent = 0);
+    ~PDFSearcher();
+
+    void         start(PDFFile * file, const QString & searchText, u32 first, u32 last);
+    void          stop();
+    bool   isSearching() const { return inFlight > 0; }
+    QString    getText() const { return text;         }
+    u32    getSearched() const { return searched;     }
+
+  signals:
+    void hitsFound(u32 page, const QList<QRectF> & boxes);
+    void  finished();
+
+  private slots:
+    void pageSearched(int page, int generation, QList<QRectF> boxes);
+
+  private:
+    friend class SearchJob;
+
+    PDFFile         * pdfFile;
+    QString           text;
+    QAtomicInt        generation;  // Incremented by each search
+    QVector<u32>      order;       // Pages in search order
+    int               next;        // Index in order of the next page to search
+    u32               inFlight;    // Jobs of the current search not signaled yet
+    u32               maxInFlight;
+    u32               searched;    // Pages searched by the current search
+
+    // Jobs given to the pool and not done yet, whatever their search. The
+    // file must not be released before they are done.
+    QMutex            mutex;
+    QWaitCondition    condition;
+    QList<SearchJob *> pending;    // Not started by the pool yet
+    u32               running;
+
+    void       startJobs();
+    void         jobDone();
+    void releaseContexts();
+};
+
+#endif // PDFSEARCHER_H
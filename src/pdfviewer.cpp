@@ -17,6 +17,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "pdfviewer.h"
+#include "pagecodec.h"
+#include "pagedecoder.h"
 
 #include <QString>
 #include <QRect>
@@ -26,10 +28,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <QKeyEvent>
 #include <QClipboard>
 #include <QGuiApplication>
-#include <TextOutputDev.h>
 #include <QDebug>
 #include <QMessageBox>
 #include <QApplication>
+#include <QThread>
+#include <cmath>
+#include <algorithm>
 
 #define CTRL_PRESSED event->modifiers().testFlag(Qt::ControlModifier)
 #define LEFT_BUTTON  (event->button() == Qt::LeftButton)
@@ -62,9 +66,26 @@ PDFViewer::PDFViewer(QWidget * parent) : QWidget(parent),
                  selector(NULL),
                  clipText(""),
       wasMouseDoubleClick(false),
-//               cachedSize(7 * 1024 * 1024),
+                  pixmaps(PIXMAP_CACHE_MAX),
+               pixmapHits(0),
+             pixmapMisses(0),
+         pixmapPrefetches(0),
+         decodeGeneration(0),
+            scaledPixmaps(SCALED_CACHE_MAX),
+             scaledLayout(),
+                   layout(),
+              layoutValid(false),
+                 topValid(0),
+              metricsSeen(0),
+                drawnXOff(0.0f),
+            prefetchFirst(0),
+             prefetchLast(0),
+          scrollDirection(1),
            singlePageTrim(false),
-            fileIsLoading(false)
+            fileIsLoading(false),
+                 hitCount(0),
+                  hitPage(-1),
+                 hitIndex(0)
 {
   setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
   update();
@@ -72,16 +93,6 @@ PDFViewer::PDFViewer(QWidget * parent) : QWidget(parent),
 
   customTrim.initialized = false;
   customTrim.similar     = true;
-  customTrim.singles     = NULL;
-
-  // Initialize the uncompressed images cache
-  srand(time(NULL));
-
-  for (u32 i = 0; i < CACHE_MAX; i++) {
-//    cache[i]      = (u8 *) xcalloc(cachedSize, 1);
-    cachedPage[i] = USHRT_MAX;
-    pix[i]        = QPixmap();
-  }
 
   setFocusPolicy(Qt::StrongFocus);
 
@@ -90,10 +101,27 @@ PDFViewer::PDFViewer(QWidget * parent) : QWidget(parent),
   singleClickTimer = new QTimer(this);
   singleClickTimer->setSingleShot(true);
   connect(singleClickTimer, SIGNAL(timeout()), this, SLOT(singleMouseClick()));
+
+  // One page decoded each time the event loop is idle
+  prefetchTimer = new QTimer(this);
+  prefetchTimer->setSingleShot(true);
+  connect(prefetchTimer, SIGNAL(timeout()), this, SLOT(prefetchPages()));
+
+  // Decoding is much faster than rendering: two threads are enough to
+  // keep up with scrolling, leaving the others to the loader
+  decoderPool.setMaxThreadCount(qMin(QThread::idealThreadCount(), 2));
+
+  searcher = new PDFSearcher(this);
+  connect(searcher, &PDFSearcher::hitsFound, this, &PDFViewer::hitsFound);
+  connect(searcher, &PDFSearcher::finished,  this, &PDFViewer::searchFinished);
 }
 
 PDFViewer::~PDFViewer()
 {
+  decoderPool.clear();
+  decoderPool.waitForDone();
+  searcher->stop();
+
   if (singleClickTimer) {
     singleClickTimer->stop();
     delete singleClickTimer;
@@ -102,9 +130,11 @@ PDFViewer::~PDFViewer()
 
 void PDFViewer::setPDFFile(PDFFile * f)
 {
-  pdfFile = f;
+  pdfFile     = f;
+  layoutValid = false;
 
-  connect(pdfFile, SIGNAL(pageLoadCompleted()), this, SLOT(refreshView()));
+  connect(pdfFile, SIGNAL(pagesReady(QList<u32>)), this, SLOT(refreshPages(QList<u32>)));
+  connect(pdfFile, SIGNAL(      fileIsValid()), this, SLOT(fileIsValid()));
 
   update();
 }
@@ -124,6 +154,9 @@ void PDFViewer::keyPressEvent(QKeyEvent * event)
     case Qt::Key_PageUp:   pageUp();          break;
     case Qt::Key_Right:    pageDown();        break;
     case Qt::Key_Left:     pageUp();          break;
+    case Qt::Key_F3:
+      if (event->modifiers().testFlag(Qt::ShiftModifier)) previousHit(); else nextHit();
+      break;
 
     default:
       if (event->matches(QKeySequence::Copy)) {
@@ -371,11 +404,9 @@ QSize PDFViewer::sizeHint() const
 
 QStringList PDFViewer::getSinglePageTrims()
 {
-  SinglePageTrim * pt = customTrim.singles;
   QStringList list;
-  while (pt) {
-    list.append(QString("%1").arg(pt->page + 1));
-    pt = pt->next;
+  for (const SinglePageTrim & s : customTrim.singles) {
+    list.append(QString("%1").arg(s.page + 1));
   }
   return list;
 }
@@ -393,12 +424,7 @@ bool PDFViewer::getFileViewParameters(FileViewParameters & params)
   params.viewZoom       = viewZoom         ;
   params.customTrim     = customTrim       ;
 
-  if (customTrim.initialized) {
-    copySingles(customTrim, params.customTrim);
-  }
-  else {
-    params.customTrim.singles = NULL;
-  }
+  if (!customTrim.initialized) params.customTrim.singles.clear();
 
   return true;
 }
@@ -407,13 +433,9 @@ void PDFViewer::setFileViewParameters(FileViewParameters & params)
 {
   silent = true;
 
-  if (customTrim.initialized) clearSingles(customTrim);
-
   customTrim = params.customTrim;
 
-  if (customTrim.initialized) {
-    copySingles(params.customTrim, customTrim);
-  }
+  if (!customTrim.initialized) customTrim.singles.clear();
 
   setColumnCount(params.columns);
   setTitlePageCount(params.titlePageCount);
@@ -434,9 +456,31 @@ void PDFViewer::reset()
   //adjustYOff(0.0f);
   resetSelection();
 
-  for (u32 i = 0; i < CACHE_MAX; i++) {
-    cachedPage[i] = USHRT_MAX;
+  layoutValid = false;
+
+  if (details && (pixmapHits + pixmapMisses > 0)) {
+    qInfo() << "Pixmap cache:" << pixmapHits << "hits," << pixmapMisses << "misses," <<
+      pixmapPrefetches << "pages prefetched" << Qt::endl;
   }
+
+  // The decoders still running keep a reference to the previous document
+  // pages: they must be done before it is released
+  prefetchTimer->stop();
+  decoderPool.clear();
+  decoderPool.waitForDone();
+  decoding.clear();
+  decodeGeneration += 1;
+
+  pixmaps.clear();
+  scaledPixmaps.clear();
+  pixmapHits = pixmapMisses = pixmapPrefetches = 0;
+  scrollDirection = 1;
+
+  // The search jobs also use the document
+  searcher->stop();
+  searchHits.clear();
+  hitCount = 0;
+  hitPage  = -1;
 }
 
 void PDFViewer::sendState()
@@ -456,12 +500,15 @@ void PDFViewer::sendState()
   state.trimSimilar    = customTrim.similar;
   state.thisPageTrim   = singlePageTrim;
   state.someClipText   = clipText.size() > 0;
+  state.searchHits     = searcher->getText().isEmpty() ? -1 : hitCount;
+  state.searching      = searcher->isSearching();
 
   if (pdfFile->totalSize > 0) {
-    state.metrics = QString(tr("Mem %1MB\nRatio %2%\nTime %3s"))
+    state.metrics = QString(tr("Mem %1MB\nRatio %2%\nTime %3s\nHits %4%"))
         .arg((float)pdfFile->totalSizeCompressed / 1000000.0f, 0, 'f', 2)
         .arg((float)(pdfFile->totalSizeCompressed) / pdfFile->totalSize * 100.0, 0, 'f', 1)
-        .arg((float)pdfFile->loadTime / 1000000.0f, 0, 'f', 2);
+        .arg((float)pdfFile->loadTime / 1000000.0f, 0, 'f', 2)
+        .arg(100.0f * pixmapHits / qMax(pixmapHits + pixmapMisses, 1u), 0, 'f', 1);
   }
   else {
     state.metrics = "";
@@ -470,48 +517,6 @@ void PDFViewer::sendState()
   emit stateUpdated(state);
 }
 
-void copySingles(CustomTrim &from, CustomTrim &to)
-{
-  SinglePageTrim *curr, *curr_i, *prev;
-
-  if (!from.initialized) {
-    to.singles = NULL;
-    return;
-  }
-
-  curr_i = from.singles;
-  prev = NULL;
-
-  while (curr_i) {
-    curr = (SinglePageTrim *) xmalloc(sizeof(SinglePageTrim));
-    *curr = *curr_i;
-    if (prev) {
-      prev->next = curr;
-    }
-    else {
-      to.singles = curr;
-    }
-    prev = curr;
-    curr->next = NULL;
-    curr_i = curr_i->next;
-  }
-}
-
-void clearSingles(CustomTrim & customTrim)
-{
-  SinglePageTrim *curr, *next;
-
-  if (customTrim.initialized) {
-    curr = customTrim.singles;
-    while (curr) {
-      next = curr->next;
-      free(curr);
-      curr = next;
-    }
-  }
-  customTrim.singles = NULL;
-}
-
 void PDFViewer::endOfSelection()
 {
   s32 X, Y, W, H;
@@ -624,14 +629,14 @@ void PDFViewer::endOfSelection()
 
       // TO BE COMPLETED!!!
 
-    TextOutputDev * const dev = new TextOutputDev(NULL, true, 0, false, false);
-    pdfFile->pdf->displayPage(dev, pp->page + 1, 144, 144, 0, true, false, false);
-    GooString *str = dev->getText(X, Y, X + W, Y + H);
-//  const char * const cstr = str->getCString();
-    const char * const cstr = str->c_str();
+    // Saved for clipboard retrieval. The text layout of a visible page is
+    // normally built by a worker. If not yet, it is built here.
+    const QRectF area(X, Y, W, H);
 
-    // Save it for clipboard retrieval
-    clipText = cstr;
+    if (!pdfFile->getText(pp->page, area, clipText)) {
+      pdfFile->insertTextLayout(pp->page, PDFFile::buildTextLayout(pdfFile->pdf, pp->page));
+      pdfFile->getText(pp->page, area, clipText);
+    }
 
     if (preferences.viewClipboardSelection) {
       QMessageBox msgBox;
@@ -651,9 +656,6 @@ void PDFViewer::endOfSelection()
       }
     }
 
-    delete str;
-    delete dev;
-
     sendState();
   }
   else if (trimZoneSelection) {
@@ -700,15 +702,22 @@ ZoneLoc PDFViewer::getZoneLoc(s32 x, s32 y) const
   else                                           return TZL_NONE;
 }
 
+// Index of the page in the sorted single page trims, or of the position
+// where it would be inserted
+static int singlePageTrimIndex(const QVector<SinglePageTrim> & singles, s32 page)
+{
+  auto it = std::lower_bound(singles.cbegin(), singles.cend(), page,
+                             [](const SinglePageTrim & s, s32 p) { return s.page < p; });
+  return it - singles.cbegin();
+}
+
 QRect PDFViewer::getTrimmingForPage(s32 page) const
 {
-  SinglePageTrim * curr = customTrim.singles;
+  const int idx = singlePageTrimIndex(customTrim.singles, page);
   QRect result;
 
-  while (curr && (curr->page < page)) curr = curr->next;
-
-  if (curr && (curr->page == page)) {
-    result = curr->pageTrim;
+  if ((idx < customTrim.singles.size()) && (customTrim.singles[idx].page == page)) {
+    result = customTrim.singles[idx].pageTrim;
   }
   else {
     if (page & 1) {
@@ -725,8 +734,6 @@ QRect PDFViewer::getTrimmingForPage(s32 page) const
 // Compute the height of a page
 u32 PDFViewer::pageH(u32 page) const
 {
-  if (!pdfFile->cache[page].ready) page = 0;
-
   s32 h;
 
   if (viewMode == VM_TRIM || viewMode == VM_PGTRIM) {
@@ -753,8 +760,6 @@ u32 PDFViewer::pageH(u32 page) const
 // Compute the width of a page
 u32 PDFViewer::pageW(u32 page) const
 {
-  if (!pdfFile->cache[page].ready) page = 0;
-
   if (viewMode == VM_TRIM || viewMode == VM_PGTRIM) {
     return pdfFile->cache[page].w;
   }
@@ -778,8 +783,6 @@ u32 PDFViewer::pageW(u32 page) const
 // largest in height.
 u32 PDFViewer::fullH(u32 page) const
 {
-  if (!pdfFile->cache[page].ready) page = 0;
-
   u32 fh = 0;
   u32 h;
   u32 i, limit;
@@ -827,14 +830,6 @@ u32 PDFViewer::fullW(u32 page) const
 
 bool PDFViewer::hasMargins(const u32 page) const
 {
-  if (!pdfFile->cache[page].ready) {
-    return
-      pdfFile->cache[0].left   > MARGIN ||
-      pdfFile->cache[0].right  > MARGIN ||
-      pdfFile->cache[0].top    > MARGIN ||
-      pdfFile->cache[0].bottom > MARGIN;
-  }
-
   return
     pdfFile->cache[page].left   > MARGIN ||
     pdfFile->cache[page].right  > MARGIN ||
@@ -842,9 +837,26 @@ bool PDFViewer::hasMargins(const u32 page) const
     pdfFile->cache[page].bottom > MARGIN;
 }
 
+// Return the required zoom factor to fit the line of pages on the screen,
+// from the layout when firstPage starts a line.
+float PDFViewer::lineZoomFactor(const u32 firstPage, u32 &retWidth, u32 &retHeight) const
+{
+  updateLayout();
+
+  const s32 line = lineOfPage(firstPage);
+
+  if ((line >= 0) && (lineStart[line] == firstPage)) {
+    retWidth  = lineWidth[line];
+    retHeight = lineHeight[line];
+    return lineZoom[line];
+  }
+
+  return computeLineZoom(firstPage, retWidth, retHeight);
+}
+
 // Compute the required zoom factor to fit the line of pages on the screen,
 // according to the zoom mode parameter if not a custom zoom.
-float PDFViewer::lineZoomFactor(const u32 firstPage, u32 &retWidth, u32 &retHeight) const
+float PDFViewer::computeLineZoom(const u32 firstPage, u32 &retWidth, u32 &retHeight) const
 {
   const u32 lineWidth  = fullW(firstPage);
   const u32 lineHeight = fullH(firstPage);
@@ -877,12 +889,104 @@ float PDFViewer::lineZoomFactor(const u32 firstPage, u32 &retWidth, u32 &retHeig
   return zoomFactor;
 }
 
+ViewLayout PDFViewer::viewLayout() const
+{
+  size_t trims = 0;
+
+  if ((viewMode == VM_CUSTOMTRIM) && !trimZoneSelection && customTrim.initialized) {
+    trims = qHashMulti(0, customTrim.odd.x(),  customTrim.odd.y(),  customTrim.odd.width(),  customTrim.odd.height(),
+                          customTrim.even.x(), customTrim.even.y(), customTrim.even.width(), customTrim.even.height());
+    for (const SinglePageTrim & s : customTrim.singles) {
+      trims = qHashMulti(trims, s.page, s.pageTrim.x(), s.pageTrim.y(), s.pageTrim.width(), s.pageTrim.height());
+    }
+  }
+
+  return {
+    width(), height(), viewMode, columns, titlePages,
+    (viewMode == VM_ZOOMFACTOR) ? viewZoom : 0.0f,
+    pdfFile->pages,
+    preferences.horizontalPadding, preferences.verticalPadding,
+    trims,
+    (viewMode == VM_CUSTOMTRIM) && trimZoneSelection
+  };
+}
+
+// Index of the line holding a page. The first line only holds the title
+// pages, if any.
+s32 PDFViewer::lineOfPage(const u32 page) const
+{
+  if (page >= pdfFile->pages) return -1;
+
+  if ((titlePages > 0) && (titlePages < columns)) {
+    return (page < titlePages) ? 0 : 1 + (page - titlePages) / columns;
+  }
+
+  return page / columns;
+}
+
+// Build the layout if the view parameters changed, otherwise update the
+// lines with pages that got their metrics. The lines top positions are
+// then summed from the first line changed.
+void PDFViewer::updateLayout() const
+{
+  if ((pdfFile == nullptr) || (pdfFile->cache == nullptr)) return;
+
+  const ViewLayout current = viewLayout();
+
+  if (!layoutValid || !(current == layout)) {
+    layout      = current;
+    layoutValid = true;
+
+    // Pending changes are included
+    pdfFile->metricsChangesSince(metricsSeen);
+
+    const s32 lines = (pdfFile->pages == 0) ? 0 : lineOfPage(pdfFile->pages - 1) + 1;
+
+    lineStart .resize(lines);
+    lineWidth .resize(lines);
+    lineHeight.resize(lines);
+    lineZoom  .resize(lines);
+    lineTop   .resize(lines + 1);
+
+    for (s32 i = 0; i < lines; i++) {
+      lineStart[i] = ((i == 0) || (titlePages == 0) || (titlePages >= columns)) ?
+                     i * columns : titlePages + (i - 1) * columns;
+      lineZoom[i]  = computeLineZoom(lineStart[i], lineWidth[i], lineHeight[i]);
+    }
+
+    topValid = 0;
+  }
+  else {
+    for (u32 page : pdfFile->metricsChangesSince(metricsSeen)) {
+      const s32 line = lineOfPage(page);
+      if (line < 0) continue;
+
+      lineZoom[line] = computeLineZoom(lineStart[line], lineWidth[line], lineHeight[line]);
+      if (line < topValid) topValid = line;
+    }
+  }
+
+  const s32 lines = lineStart.size();
+
+  if (topValid < lines) {
+    lineTop[0] = 0;
+    for (s32 i = topValid; i < lines; i++) {
+      const u32 h = lineZoom[i] * (lineHeight[i] + preferences.verticalPadding);
+      lineTop[i + 1] = lineTop[i] + h;
+    }
+    topValid = lines;
+  }
+}
+
 // From the current zoom mode and view offset, update the visible page info
 // Will adjust the following parameters:
 //
 // - pdfFile->firstVisible
 // - pdfFile->lastVisible
 //
+// The PDFLoader is following these values to decide which pages
+// to render first.
+//
 // This method as been extensively modified to take into account multicolumns
 // and the fact that no page will be expected to be of the same size as the others,
 // both for vertical and horizontal limits. Because of these constraints, the
@@ -899,51 +1003,258 @@ void PDFViewer::updateVisible() const
 
   // Adjust file->first_visible
 
-  pdfFile->firstVisible = yOff < 0.0f ? 0 : yOff;
-  if (pdfFile->firstVisible > pdfFile->pages - 1) {
-    pdfFile->firstVisible = pdfFile->pages - 1;
+  u32 newFirstVisible = yOff < 0.0f ? 0 : yOff;
+  if (newFirstVisible > pdfFile->pages - 1) {
+    newFirstVisible = pdfFile->pages - 1;
   }
 
   // Adjust file->last_visible
 
-  u32 newLastVisible = pdfFile->firstVisible + maxLinesPerScreen[columns - 1] * columns;
+  u32 newLastVisible = newFirstVisible + maxLinesPerScreen[columns - 1] * columns;
   if (newLastVisible >= pdfFile->pages) {
-    pdfFile->lastVisible = pdfFile->pages - 1;
-  }
-  else {
-    pdfFile->lastVisible = newLastVisible;
+    newLastVisible = pdfFile->pages - 1;
   }
+
+  // The loader is told about the change to reorder its rendering queue
+  pdfFile->setVisible(newFirstVisible, newLastVisible);
 }
 
-// Put an uncompressed page Pixmap version in the cache if not already
-// available. Return the uncompressed page.
-QPixmap PDFViewer::getPage(const u32 page)
+// Return the uncompressed page if already decoded. Otherwise, a decoder
+// is started if decode is true and a null pixmap is returned: the view
+// is refreshed when the page is ready. A scale other than 1.0 selects the
+// sharper version of the page, PREVIEW_SCALE the preview.
+QPixmap PDFViewer::getPage(const u32 page, const float scale, const bool decode)
 {
-  for (u32 i = 0; i < CACHE_MAX; i++) {
-    if (cachedPage[i] == page) return pix[i]; // Already there
+  const PixmapKey key = { page, scale };
+
+  QPixmap * cached = pixmaps.object(key);
+  if (cached != nullptr) {
+    pixmapHits += 1;
+    return *cached;
   }
 
+  if (decode && !decoding.contains(key) && decodePage(page, scale, 1)) pixmapMisses += 1;
+
+  return QPixmap();
+}
+
+// Give a page to a decoder. The pages drawn on screen have priority over
+// the prefetched ones. False if the page is not available at that scale.
+bool PDFViewer::decodePage(const u32 page, const float scale, const int priority)
+{
   CachedPage * const cur = &pdfFile->cache[page];
 
   // Be safe
-  if (!cur->ready) return QPixmap();
-
-  // Insert it in the cache. Pick the slot at random.
+  if ((scale == PREVIEW_SCALE) ? !cur->previewReady : !cur->isReady()) return false;
 
   // qDebug() << "Page: " << page << ", Size: " << cur->data.size();
 
-  QImage img(cur->w, cur->h, QImage::Format_RGB32);
-  img.loadFromData(cur->data, "PNG");
+  // The loader may drop the sharper version at any time, and evict the
+  // page when over its memory budget: keep a reference to the data
+  pdfFile->cacheMutex.lock();
+  QByteArray data;
+  if      (scale == PREVIEW_SCALE)      data = cur->previewData;
+  else if (scale != 1.0f)               data = (cur->hiresScale == scale) ? cur->hiresData : QByteArray();
+  else if (cur->isReady())              data = cur->data;
+  pdfFile->cacheMutex.unlock();
+
+  if (data.isEmpty()) return false;
+
+  PageDecoder * decoder = new PageDecoder(data, page, scale, decodeGeneration);
+
+  connect(decoder, SIGNAL(decoded(int, float, int, QImage)),
+          this,    SLOT(pageDecoded(int, float, int, QImage)), Qt::QueuedConnection);
+
+  decoding.insert({ page, scale });
+  decoderPool.start(decoder, priority);
+
+  return true;
+}
+
+// A decoder is done. The pixmap conversion is only a copy, the image
+// being already in the pixmap format.
+void PDFViewer::pageDecoded(int page, float scale, int generation, QImage image)
+{
+  if (generation != decodeGeneration) return;
+
+  const PixmapKey key = { (u32) page, scale };
+  decoding.remove(key);
+
+  if (image.isNull()) {
+    qCritical() << tr("Unable to decode page") << page << Qt::endl;
+    return;
+  }
+
+  QPixmap * pix = new QPixmap(QPixmap::fromImage(image));
+
+  const qsizetype cost = (qsizetype) pix->width() * pix->height() * pix->depth() / 8;
+  pixmaps.insert(key, pix, cost);
+
+  if (((u32) page >= prefetchFirst) && ((u32) page <= prefetchLast)) updatePage(page);
+}
+
+// Return the page scaled to the size it is drawn on screen, in device
+// pixels, so that painting is a plain copy. Scaled once per zoom factor
+// and trimming. A null pixmap is returned when the scaled page would not
+// fit in the cache: it would be scaled again on every paint.
+QPixmap PDFViewer::scaledPage(const u32 page, const float scale, const QPixmap & pix,
+                              const QSize & size)
+{
+  const float     dpr  = devicePixelRatioF();
+  const ScaledKey key  = { page, scale, size.width(), size.height(), dpr };
+  const QSize     dev  = size * dpr;
+  const qsizetype cost = (qsizetype) dev.width() * dev.height() * 4;
+
+  if (cost > scaledPixmaps.maxCost()) return QPixmap();
+
+  QPixmap * cached = scaledPixmaps.object(key);
+  if (cached != nullptr) return *cached;
+
+  QPixmap scaled = pix.scaled(dev, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+  scaled.setDevicePixelRatio(dpr);
+
+  scaledPixmaps.insert(key, new QPixmap(scaled), cost);
+
+  return scaled;
+}
+
+// Decode the full version of the pages following the visible ones in the
+// scrolling direction, a screenful ahead, so that the next page down
+// finds them in the cache. They use at most half of the cache, the
+// visible pages being kept in the other half.
+void PDFViewer::prefetchPages()
+{
+  if ((pdfFile == nullptr) || !pdfFile->isValid() || !pdfFile->cache) return;
+
+  const s32 count = prefetchLast - prefetchFirst + 1;
+  qint64    cost  = 0;
+
+  for (s32 i = 1; i <= count; i++) {
+    const s32 page = (scrollDirection < 0) ? (s32) prefetchFirst - i : (s32) prefetchLast + i;
+    if ((page < 0) || (page >= (s32) pdfFile->pages)) return;
+
+    cost += (qint64) pdfFile->cache[page].w * pdfFile->cache[page].h * 4;
+    if (cost > pixmaps.maxCost() / 2) return;
+
+    const PixmapKey key = { (u32) page, 1.0f };
+    if (pixmaps.contains(key) || decoding.contains(key)) continue;
+
+    // One per event loop iteration: the events in between are not delayed
+    if (decodePage(page, 1.0f, 0)) {
+      pixmapPrefetches += 1;
+      prefetchTimer->start(0);
+      return;
+    }
+  }
+}
+
+// Return the scale, relative to the 144 DPI rendering, at which a page
+// drawn W pixels wide should be rendered to stay sharp. 1.0 if the
+// standard rendering is good enough. tiled is set when the page at that
+// scale is too big to be rendered as a whole.
+float PDFViewer::wantedResolution(const u32 page, const s32 W, bool & tiled) const
+{
+  const CachedPage & cur = pdfFile->cache[page];
+
+  tiled = false;
+
+  if ((cur.w == 0) || (cur.h == 0)) return 1.0f;
+
+  float scale = (W * devicePixelRatioF()) / cur.w;
+
+  if (scale < HIRES_THRESHOLD) return 1.0f;
+
+  // Quantized to limit the number of re-renderings while zooming
+  scale = qMin(ceilf(scale / HIRES_STEP) * HIRES_STEP, TILES_MAX_SCALE);
+
+  tiled = (scale * scale * cur.w * cur.h) > HIRES_MAX_PIXELS;
+
+  return scale;
+}
+
+// Draw the tiles of a page available at the given scale over the page
+// content drawn in rect. The visible tiles not yet rendered are added
+// to the missing list.
+void PDFViewer::drawTiles(QPainter & painter, const u32 page, const float scale,
+                          const QRect & rect, QList<TileKey> & missing)
+{
+  const CachedPage & cur = pdfFile->cache[page];
+
+  // Page pixels to screen pixels
+  const float fx = rect.width()  / (cur.w * scale);
+  const float fy = rect.height() / (cur.h * scale);
+
+  const float originX = cur.left * scale;
+  const float originY = cur.top  * scale;
+
+  const float pageW = (cur.left + cur.w + cur.right ) * scale;
+  const float pageH = (cur.top  + cur.h + cur.bottom) * scale;
+
+  QRect visible = rect.intersected(this->rect());
+  if (painter.hasClipping()) visible = visible.intersected(painter.clipBoundingRect().toRect());
+  if (visible.isEmpty()) return;
 
-  const u32 dst = rand() % CACHE_MAX;
+  const s32 firstX = (originX + (visible.left()   - rect.x()) / fx) / TILE_SIZE;
+  const s32 firstY = (originY + (visible.top()    - rect.y()) / fy) / TILE_SIZE;
+  const s32 lastX  = qMin(originX + (visible.right()  + 1 - rect.x()) / fx, pageW - 1) / TILE_SIZE;
+  const s32 lastY  = qMin(originY + (visible.bottom() + 1 - rect.y()) / fy, pageH - 1) / TILE_SIZE;
 
-  if (!pix[dst].convertFromImage(img)) {
-    qCritical() << tr("Fatal: QPixmap::convertFromImage failed") << Qt::endl;
-    exit(1);
+  painter.save();
+  if (painter.hasClipping()) {
+    painter.setClipRect(visible, Qt::IntersectClip);
   }
+  else {
+    painter.setClipRect(visible);
+  }
+
+  for (s32 ty = firstY; ty <= lastY; ty++) {
+    for (s32 tx = firstX; tx <= lastX; tx++) {
+      const TileKey key = { page, scale, (u16) tx, (u16) ty };
+      QImage tile;
+
+      if (!pdfFile->getTile(key, tile)) {
+        missing.append(key);
+        continue;
+      }
 
-  cachedPage[dst] = page;
-  return pix[dst];
+      const QRectF target(
+        rect.x() + (tx * TILE_SIZE - originX) * fx,
+        rect.y() + (ty * TILE_SIZE - originY) * fy,
+        tile.width()  * fx,
+        tile.height() * fy);
+
+      painter.drawImage(target, tile);
+    }
+  }
+
+  painter.restore();
+}
+
+// The hits are located in the whole page at 144 DPI. The page content,
+// starting at its left and top margins, is drawn in rect.
+void PDFViewer::drawHits(QPainter & painter, const u32 page, const QRect & rect)
+{
+  const auto it = searchHits.constFind(page);
+  if (it == searchHits.constEnd()) return;
+
+  const CachedPage & cur = pdfFile->cache[page];
+  if ((cur.w == 0) || (cur.h == 0)) return;
+
+  const float fx = rect.width()  / (float) cur.w;
+  const float fy = rect.height() / (float) cur.h;
+
+  for (int i = 0; i < it->size(); i++) {
+    const QRectF & box = it->at(i);
+
+    const QRectF target(
+      rect.x() + (box.x() - cur.left) * fx,
+      rect.y() + (box.y() - cur.top ) * fy,
+      box.width()  * fx,
+      box.height() * fy);
+
+    const bool current = ((s32) page == hitPage) && (i == hitIndex);
+    painter.fillRect(target, current ? QColor(255, 128, 0, 128) : QColor(255, 255, 0, 96));
+  }
 }
 
 void PDFViewer::paintEvent(QPaintEvent * event)
@@ -955,8 +1266,10 @@ void PDFViewer::paintEvent(QPaintEvent * event)
 
   painter.setRenderHint(QPainter::SmoothPixmapTransform);
 
-  // Paint background
-  painter.fillRect(geometry(), QColor("gray"));
+  // Paint background. Only the damaged region is painted: the rest of
+  // the window is already up to date (moved by scrollView() for example).
+  const QRegion & damaged = event->region();
+  painter.fillRect(event->rect(), QColor("gray"));
 
   if (!pdfFile->isValid()) return;
 
@@ -964,14 +1277,21 @@ void PDFViewer::paintEvent(QPaintEvent * event)
 
   updateVisible();
 
+  // A new zoom factor, window size or layout: pages are scaled again
+  const ViewLayout current = viewLayout();
+  if (!(current == scaledLayout)) {
+    scaledPixmaps.clear();
+    scaledLayout = current;
+  }
+
   const QColor pageColor("white");
 
+  QList<TileKey> missingTiles;
+
   int X, Y, W, H;
   int Xs, Ys, Ws, Hs; // Saved values
 
-  CachedPage * cur = &pdfFile->cache[pdfFile->firstVisible];
-
-  if (!cur->ready) return;
+  CachedPage * cur;
 
   if (viewMode != VM_ZOOMFACTOR) xOff = 0.0f;
 
@@ -987,6 +1307,9 @@ void PDFViewer::paintEvent(QPaintEvent * event)
 
   const float invisibleY = yOff - floorf(yOff);
 
+  drawnLines.clear();
+  drawnXOff = xOff;
+
   // pp will hold all topological information required to identify the selection
   // made by the user with mouse movements
   PagePos * pp = pagePosOnScreen;
@@ -1018,6 +1341,8 @@ void PDFViewer::paintEvent(QPaintEvent * event)
       Y = y() - invisibleY * H;
     }
 
+    drawnLines.append({ firstPageInLine, Y, H });
+
     X = x() +
         width() / 2 -
         zoom * lineWidth / 2 +
@@ -1036,14 +1361,22 @@ void PDFViewer::paintEvent(QPaintEvent * event)
     while ((column < limit) && (page < pdfFile->pages)) {
 
       cur = &pdfFile->cache[page];
-      if (!cur->ready)
-        break;
 
       H = pageH(page) * zoom;
       W = pageW(page) * zoom;
 
       // Paint the page backgroud rectangle, save coordinates for next loop
-      painter.fillRect(QRect(Xs = X, Ys = Y, Ws = W, Hs = H), pageColor);
+      const bool visible = damaged.intersects(QRect(Xs = X, Ys = Y, Ws = W, Hs = H));
+      if (visible) painter.fillRect(QRect(Xs, Ys, Ws, Hs), pageColor);
+
+      if (!cur->hasMetrics()) {
+        // Not rendered yet: the blank page is a placeholder
+        X += preferences.horizontalPadding + W;
+        page++; column++;
+
+        firstPage = false;
+        continue;
+      }
 
       #if DEBUGGING && 0
         if (firstPage) {
@@ -1125,7 +1458,47 @@ void PDFViewer::paintEvent(QPaintEvent * event)
       }
 
       // qDebug() << "Page: " << page;
-      QPixmap img = getPage(page);
+      QPixmap img;
+      float   imgScale = 1.0f;
+
+      // When zoomed in, use the sharper version once available. The
+      // 144 DPI version is scaled up in the meantime. When the sharper
+      // version would be too big, visible tiles are drawn over it.
+      bool tiled = false;
+      bool hires = false;
+      const float scale = cur->isReady() ? wantedResolution(page, W, tiled) : 1.0f;
+
+      if ((scale != 1.0f) && !tiled) {
+        pdfFile->cacheMutex.lock();
+        hires = (cur->hiresScale == scale);
+        pdfFile->cacheMutex.unlock();
+
+        if (hires && visible) {
+          img      = getPage(page, scale);
+          imgScale = scale;
+        }
+        else if (!hires) {
+          pdfFile->requestResolution(page, scale);
+        }
+      }
+
+      // While the sharper version is decoded, the full one is drawn if
+      // already available. Until the full rendering lands (or while an
+      // evicted page is rendered again or a page decoded), the preview
+      // is drawn.
+      if (img.isNull() && cur->rendered && visible) {
+        img      = getPage(page, 1.0f, !hires);
+        imgScale = 1.0f;
+      }
+      if (img.isNull() && visible) {
+        img      = getPage(page, PREVIEW_SCALE);
+        imgScale = PREVIEW_SCALE;
+      }
+
+      // Read by the loader thread when evicting pages
+      pdfFile->cacheMutex.lock();
+      cur->lastUsed = ++pdfFile->usageClock;
+      pdfFile->cacheMutex.unlock();
 
       // Render real content
 //      if (firstPage) {
@@ -1133,8 +1506,25 @@ void PDFViewer::paintEvent(QPaintEvent * event)
 //                 page, X, Y, W, H, img.size());
 //      }
 
-      // Do render the page on the canvas
-      painter.drawPixmap(QRect(X, Y, W, H), img);
+      // Do render the page on the canvas. Nothing decoded yet: the blank
+      // page stays.
+      // A tiled page is covered by its tiles, its base version is only
+      // seen until they are rendered: not worth scaling.
+      if (!img.isNull() && (W > 0) && (H > 0)) {
+        const QPixmap scaled = ((imgScale == PREVIEW_SCALE) || tiled) ?
+                                 QPixmap() : scaledPage(page, imgScale, img, QSize(W, H));
+
+        if (scaled.isNull()) {
+          painter.drawPixmap(QRect(X, Y, W, H), img);
+        }
+        else {
+          painter.drawPixmap(X, Y, scaled);
+        }
+      }
+
+      if (tiled) drawTiles(painter, page, scale, QRect(X, Y, W, H), missingTiles);
+
+      if (visible && (W > 0) && (H > 0)) drawHits(painter, page, QRect(X, Y, W, H));
 
       if (painter.hasClipping()) painter.setClipping(false);
 
@@ -1220,7 +1610,19 @@ void PDFViewer::paintEvent(QPaintEvent * event)
     firstLine = false;
   }
 
-  pdfFile->lastVisible = page;
+  pdfFile->setVisible(pdfFile->firstVisible, page);
+  pdfFile->requestTiles(missingTiles);
+
+  // Prefetch from the pages actually drawn
+  const u32 first = pdfFile->firstVisible;
+  const u32 last  = (page > first) ? page - 1 : first;
+
+  if      (first > prefetchFirst) scrollDirection =  1;
+  else if (first < prefetchFirst) scrollDirection = -1;
+
+  prefetchFirst = first;
+  prefetchLast  = last;
+  prefetchTimer->start(0);
 }
 
 void PDFViewer::rubberBanding(bool show)
@@ -1266,14 +1668,40 @@ void PDFViewer::pageChanged()
   s32 page = yOff;
 
   if (trimZoneSelection) {
-    SinglePageTrim * curr = customTrim.singles;
-    while (curr && (curr->page < page)) curr = curr->next;
+    const int idx = singlePageTrimIndex(customTrim.singles, page);
 
-    singlePageTrim = curr && (curr->page == page);
+    singlePageTrim = (idx < customTrim.singles.size()) && (customTrim.singles[idx].page == page);
   }
 
   resetSelection();
   sendState();
+  scrollView();
+}
+
+// Move the window content when only the vertical offset changed since the
+// last paint event. Only the strip exposed is then painted. The lines
+// already on screen keep their size: the offset of the one now at the
+// top gives the distance.
+void PDFViewer::scrollView()
+{
+  const u32 first = (yOff < 0.0f) ? 0 : yOff;
+
+  if ((viewLayout() == scaledLayout) && (xOff == drawnXOff) && !zoneSelection) {
+    for (DrawnLine & line : drawnLines) {
+      if (line.firstPage != first) continue;
+
+      const s32 top = y() - (yOff - floorf(yOff)) * line.h;
+      const s32 dy  = top - line.y;
+
+      if ((dy != 0) && (qAbs(dy) < height())) {
+        for (DrawnLine & l : drawnLines) l.y += dy;
+        scroll(0, dy);
+        return;
+      }
+      break;
+    }
+  }
+
   update();
 }
 
@@ -1292,47 +1720,28 @@ void PDFViewer::pageChanged()
 // last = 12 - (12 % 4) - (columns - title_pages) = 12 - 0 - 3 = 9
 float PDFViewer::maxYOff() const
 {
-  float zoom, f;
-  u32   lineWidth, lineHeight, h;
-
   if (pdfFile->pages == 0) return 0.0f;
 
-  s32 pages = pdfFile->pages;
-  s32 last  = pages - 1;
+  updateLayout();
 
-  last     -= (last % columns);
-  if ((titlePages > 0) && (titlePages < columns)) {
-    last -= (columns - titlePages);
-    if (last < (pages - (s32)columns)) {
-      last += columns;
-    }
-  }
+  // The last line at the top of the screen is the one from which the
+  // following lines fill the screen height. The title pages line is never
+  // the only one considered.
+  const s32 lines = lineStart.size();
+  const s32 first = ((titlePages > 0) && (titlePages < columns) && (lines > 1)) ? 1 : 0;
+  const s64 limit = lineTop[lines] - height();
 
-  if (last < 0) last = 0;
+  const s64 * top  = lineTop.constData();
+  const s32   line = (std::upper_bound(top + first, top + lines, limit) - top) - 1;
 
-  if (!pdfFile->cache[last].ready)
-    f = last + 0.5f;
-  else {
-    s32 H = height();
+  if (line < first) return 0.0f;
 
-    while (true) {
-      zoom = lineZoomFactor(last, lineWidth, lineHeight);
-      H   -= (h = zoom * (lineHeight + preferences.verticalPadding));
+  const float zoom = lineZoom[line];
 
-      if (H <= 0) {
-        H += (preferences.verticalPadding * zoom);
-        f = last + (float)(-H) / (zoom * lineHeight);
-        break;
-      }
+  s32 H = height() - (lineTop[lines] - lineTop[line]);
+  H += (preferences.verticalPadding * zoom);
 
-      last -= columns;
-      if (last < 0) {
-        f = 0.0f;
-        break;
-      }
-    }
-  }
-  return f;
+  return lineStart[line] + (float)(-H) / (zoom * lineHeight[line]);
 }
 
 // Advance the yoff position by an offset, taking into account the number
@@ -1501,57 +1910,30 @@ void PDFViewer::thisPageTrim(bool thisPage)
 
 void PDFViewer::removeSinglePageTrim(s32 page)
 {
-  SinglePageTrim *prev, *curr, *next;
+  const int idx = singlePageTrimIndex(customTrim.singles, page);
 
-  prev = NULL;
-  curr = customTrim.singles;
-  while (curr && (curr->page < page)) {
-    prev = curr;
-    curr = curr->next;
-  }
-
-  if (curr && (curr->page == page)) {
-    next = curr->next;
-    free(curr);
-
-    if (prev) {
-      prev->next = next;
-    }
-    else {
-      customTrim.singles = next;
-    }
+  if ((idx < customTrim.singles.size()) && (customTrim.singles[idx].page == page)) {
+    customTrim.singles.remove(idx);
   }
 }
 
 void PDFViewer::addSinglePageTrim(s32 page, QRect trim)
 {
-  SinglePageTrim *prev, *curr, *s;
+  const int idx = singlePageTrimIndex(customTrim.singles, page);
 
-  prev = NULL;
-  curr = customTrim.singles;
-  while (curr && (curr->page < page)) {
-    prev = curr;
-    curr = curr->next;
+  if ((idx < customTrim.singles.size()) && (customTrim.singles[idx].page == page)) {
+    customTrim.singles[idx].pageTrim = trim;
   }
-
-  if ((curr == NULL) || (curr->page != page)) {
-    s = (SinglePageTrim *) xmalloc(sizeof(SinglePageTrim));
-    s->next = curr;
-    if (prev)
-      prev->next = s;
-    else
-      customTrim.singles = s;
-    curr = s;
+  else {
+    customTrim.singles.insert(idx, { page, trim });
   }
 
-  curr->page     = page;
-  curr->pageTrim = trim;
   sendState();
 }
 
 void PDFViewer::clearAllSingleTrims()
 {
-  clearSingles(customTrim);
+  customTrim.singles.clear();
 
   singlePageTrim = false;
 
@@ -1589,7 +1971,7 @@ void PDFViewer::trimZoneSelect(bool doSelect)
 
         customTrim.initialized = true;
         customTrim.similar     = true;
-        customTrim.singles     = NULL;
+        customTrim.singles.clear();
 
         // To insure that the initial trim zone rectangle will be visible on screen
         // We offset it off 25 pixels from the visible edges of the page
@@ -1653,6 +2035,98 @@ void PDFViewer::selectPageAt(s32 X, s32 Y, bool rightDClick)
   gotoPage(pp->page);
 }
 
+// Called when the search text is entered. The same text entered again
+// goes to the next hit.
+void PDFViewer::search(const QString & text)
+{
+  if ((text == searcher->getText()) && (hitCount > 0)) {
+    nextHit();
+    return;
+  }
+
+  searchHits.clear();
+  hitCount = 0;
+  hitPage  = -1;
+  hitIndex = 0;
+
+  searcher->start(pdfFile, text, pdfFile->firstVisible, pdfFile->lastVisible);
+
+  sendState();
+  update();
+}
+
+// Hits come in the search order: the first one is the closest to the
+// visible pages and becomes the current hit.
+void PDFViewer::hitsFound(u32 page, const QList<QRectF> & boxes)
+{
+  searchHits.insert(page, boxes);
+  hitCount += boxes.size();
+
+  if (hitPage < 0) {
+    hitPage  = page;
+    hitIndex = 0;
+    showHit();
+  }
+  else if ((page >= pdfFile->firstVisible) && (page <= pdfFile->lastVisible)) {
+    updatePage(page);
+  }
+
+  sendState();
+}
+
+void PDFViewer::searchFinished()
+{
+  sendState();
+}
+
+void PDFViewer::nextHit()
+{
+  if (hitPage < 0) return;
+
+  auto it = searchHits.constFind(hitPage);
+
+  if (hitIndex + 1 < it->size()) {
+    hitIndex += 1;
+  }
+  else {
+    if (++it == searchHits.constEnd()) it = searchHits.constBegin();
+    hitPage  = it.key();
+    hitIndex = 0;
+  }
+
+  showHit();
+}
+
+void PDFViewer::previousHit()
+{
+  if (hitPage < 0) return;
+
+  auto it = searchHits.constFind(hitPage);
+
+  if (hitIndex > 0) {
+    hitIndex -= 1;
+  }
+  else {
+    if (it == searchHits.constBegin()) it = searchHits.constEnd();
+    --it;
+    hitPage  = it.key();
+    hitIndex = it->size() - 1;
+  }
+
+  showHit();
+}
+
+// Go to the page of the current hit if not on screen
+void PDFViewer::showHit()
+{
+  if ((hitPage < (s32) pdfFile->firstVisible) || (hitPage > (s32) pdfFile->lastVisible)) {
+    gotoPage(hitPage);
+  }
+  else {
+    update();
+  }
+}
+
 void PDFViewer::gotoPage(const int page)
 {
   yOff = page;
@@ -1707,7 +2181,7 @@ void PDFViewer::endOfPage()
   u32 page = yOff;
   s32 sh   = height() * viewZoom;
 
-  if (pdfFile->cache[page].ready) {
+  if (pdfFile->cache[page].hasMetrics()) {
     const s32 hidden = sh - height();
     float tmp = floorf(yOff) + hidden / (float) sh;
     if (tmp > yOff) {
@@ -1830,3 +2304,46 @@ void PDFViewer::refreshView()
 {
   update();
 }
+
+// Visible pages rendered by the loader, in batches of a display frame
+void PDFViewer::refreshPages(const QList<u32> & pages)
+{
+  for (u32 page : pages) updatePage(page);
+}
+
+// Repaint the rectangle of a page on screen. The whole view if the page
+// size changed since it was drawn, trimmed margins being now known for
+// example: the other pages are moved.
+void PDFViewer::updatePage(const u32 page)
+{
+  const PagePos * pp = pagePosOnScreen;
+
+  for (u32 i = 0; i < pagePosCount; i++, pp++) {
+    if (pp->page != page) continue;
+
+    if (((s32) (pageW(page) * pp->zoom) != pp->W0) ||
+        ((s32) (pageH(page) * pp->zoom) != pp->H0)) {
+      update();
+    }
+    else {
+      update(pp->X0, pp->Y0, pp->W0, pp->H0);
+    }
+    return;
+  }
+
+  // Not drawn by the last paint event: nothing to refresh, unless
+  // nothing was drawn yet or the page was a blank placeholder, not
+  // having its metrics at that time
+  if ((pagePosCount == 0) ||
+      ((page >= pdfFile->firstVisible) && (page <= pdfFile->lastVisible))) {
+    update();
+  }
+}
+
+// The document has been opened by the loader thread. The view parameters
+// may have been set before that moment.
+void PDFViewer::fileIsValid()
+{
+  adjustYOff(0);
+  pageChanged();
+}
@@ -22,20 +22,95 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <QtGlobal>
 #include <QWidget>
 #include <QPixmap>
+#include <QPainter>
+#include <QCache>
+#include <QMap>
+#include <QSet>
+#include <QThreadPool>
 #include <QRubberBand>
 #include <QTimer>
 
 #include "updf.h"
 #include "pdffile.h"
 #include "loadpdffile.h"
+#include "pdfsearcher.h"
 
-#define CACHE_MAX            30
+#define PIXMAP_CACHE_MAX   (128 * 1024 * 1024)
+#define SCALED_CACHE_MAX    (64 * 1024 * 1024)
 #define PAGES_ON_SCREEN_MAX 100
 #define MAX_COLUMNS_COUNT     5
 #define MARGIN               36
 #define MARGINHALF           18
 #define SMALL_MOVE         0.05f
 
+// Pages drawn larger than HIRES_THRESHOLD times their rendered size get a
+// sharper version, in steps of HIRES_STEP. Past HIRES_MAX_PIXELS, only the
+// visible tiles are rendered, up to TILES_MAX_SCALE.
+#define HIRES_THRESHOLD     1.25f
+#define HIRES_STEP          0.5f
+#define HIRES_MAX_PIXELS   (8 * 1024 * 1024)
+#define TILES_MAX_SCALE    16.0f
+
+// Decoded page, at one of the scales available (1.0, PREVIEW_SCALE or the
+// sharper version scale)
+struct PixmapKey {
+  u32   page;
+  float scale;
+
+  bool operator==(const PixmapKey & other) const {
+    return (page == other.page) && (scale == other.scale);
+  }
+};
+
+inline size_t qHash(const PixmapKey & key, size_t seed = 0)
+{
+  return qHashMulti(seed, key.page, key.scale);
+}
+
+// Decoded page scaled to its size on screen, in device pixels
+struct ScaledKey {
+  u32   page;
+  float scale;     // Of the decoded version
+  s32   w, h;      // Logical size
+  float dpr;       // Device pixel ratio of the screen
+
+  bool operator==(const ScaledKey & other) const {
+    return (page == other.page) && (scale == other.scale) &&
+           (w    == other.w   ) && (h     == other.h    ) &&
+           (dpr  == other.dpr );
+  }
+};
+
+inline size_t qHash(const ScaledKey & key, size_t seed = 0)
+{
+  return qHashMulti(seed, key.page, key.scale, key.w, key.h, key.dpr);
+}
+
+// Parameters giving the size of the pages on screen. The layout and the
+// scaled pages are computed again when one of them changes. The zoom
+// factor is only a parameter in VM_ZOOMFACTOR mode, and the trimming in
+// VM_CUSTOMTRIM mode.
+struct ViewLayout {
+  s32      width, height;
+  ViewMode viewMode;
+  u32      columns, titlePages;
+  float    viewZoom;
+  u32      pages;
+  s32      horizontalPadding, verticalPadding;
+  size_t   trims;           // Hash of the custom trimming
+  bool     trimSelection;   // Untrimmed pages shown to select the trimming
+
+  bool operator==(const ViewLayout & other) const {
+    return (width    == other.width   ) && (height     == other.height    ) &&
+           (viewMode == other.viewMode) && (columns    == other.columns   ) &&
+           (viewZoom == other.viewZoom) && (titlePages == other.titlePages) &&
+           (pages    == other.pages   ) && (trims      == other.trims     ) &&
+           (trimSelection     == other.trimSelection    ) &&
+           (horizontalPadding == other.horizontalPadding) &&
+           (verticalPadding   == other.verticalPadding  );
+  }
+};
+
 // Used to keep drawing postion of displayed pages to
 // help in the identification of the selection zone.
 // Used by the endOffSelection method.
@@ -45,6 +120,12 @@ struct PagePos {
   int   X0, Y0, W0, H0, X, Y, W, H;
 };
 
+// Line of pages as drawn on screen by the last paint event
+struct DrawnLine {
+  u32 firstPage;
+  s32 y, h;
+};
+
 enum ZoneLoc {
   TZL_N = 0,
   TZL_S,
@@ -70,6 +151,8 @@ struct ViewState {
     bool     trimSimilar;
     bool     thisPageTrim;
     bool     someClipText;
+    int      searchHits;     // -1 if no search
+    bool     searching;
     QString  metrics;
 };
 
@@ -97,6 +180,7 @@ class PDFViewer : public QWidget
     void     setFileViewParameters(FileViewParameters & params);
     void                     reset();
     void                 sendState();
+    QString             searchText() const { return searcher->getText(); }
 
   private:
     PDFFile     * pdfFile;
@@ -126,11 +210,41 @@ class PDFViewer : public QWidget
     u32           theMouseKey;
     bool          wasMouseDoubleClick;
 
-    // caching
-    //u32           cachedSize;
-    //u8          * cache[CACHE_MAX];
-    u16           cachedPage[CACHE_MAX];
-    QPixmap       pix[CACHE_MAX];
+    // caching. The pixmaps cost is their size in bytes, the least
+    // recently drawn being evicted first. The pages following the visible
+    // ones in the scrolling direction are decoded ahead of time. Pages are
+    // decoded by the decoders pool, never while painting.
+    QCache<PixmapKey, QPixmap> pixmaps;
+    u32             pixmapHits, pixmapMisses, pixmapPrefetches;
+    QSet<PixmapKey> decoding;         // Given to a decoder
+    QThreadPool     decoderPool;
+    int             decodeGeneration; // Incremented for each document
+
+    // Pages already scaled to their size on screen, drawn without
+    // resampling. Previews are not kept: they are replaced shortly.
+    QCache<ScaledKey, QPixmap> scaledPixmaps;
+    ViewLayout      scaledLayout;
+
+    // Layout of the lines of pages, computed once for the view parameters
+    // in layout. Only the lines of pages getting their metrics are updated
+    // afterward. lineTop is the sum of the screen heights of the previous
+    // lines, up to date until line topValid.
+    mutable ViewLayout     layout;
+    mutable bool           layoutValid;
+    mutable QVector<u32>   lineStart;   // First page of each line
+    mutable QVector<u32>   lineWidth, lineHeight;
+    mutable QVector<float> lineZoom;
+    mutable QVector<s64>   lineTop;     // One more entry than lines: the total
+    mutable s32            topValid;
+    mutable u32            metricsSeen; // Position in the metrics changes of the file
+
+    // Lines of pages currently on screen. When only the vertical offset
+    // changes, the window content is moved and the exposed strip painted.
+    QVector<DrawnLine> drawnLines;
+    float           drawnXOff;
+    QTimer      * prefetchTimer;
+    u32           prefetchFirst, prefetchLast;
+    s32           scrollDirection;
 
     // custom trimming management (VM_CUSTOMTRIM)
     CustomTrim    customTrim;
@@ -138,20 +252,42 @@ class PDFViewer : public QWidget
 
     bool          fileIsLoading;
 
+    // Text search. The hits are kept by page, in page coordinates at 144
+    // DPI, as they are found. The current hit is drawn in another color.
+    PDFSearcher * searcher;
+    QMap<u32, QList<QRectF>> searchHits;
+    int           hitCount;
+    s32           hitPage;      // -1 if no current hit
+    int           hitIndex;
+
     // internal processing support methods
     void            endOfSelection();
     ZoneLoc             getZoneLoc(s32 x, s32 y) const;
     void         computeScreenSize();
-    QPixmap                getPage(const u32 page);
+    QPixmap                getPage(const u32 page, const float scale = 1.0f, const bool decode = true);
+    bool                decodePage(const u32 page, const float scale, const int priority);
+    QPixmap             scaledPage(const u32 page, const float scale, const QPixmap & pix,
+                                   const QSize & size);
+    float            wantedResolution(const u32 page, const s32 W, bool & tiled) const;
+    void                    drawTiles(QPainter & painter, const u32 page, const float scale,
+                                      const QRect & rect, QList<TileKey> & missing);
+    void                     drawHits(QPainter & painter, const u32 page, const QRect & rect);
+    void                      showHit();
     u32                      pageH(u32 page) const;
     u32                      pageW(u32 page) const;
     u32                      fullH(u32 page) const;
     u32                      fullW(u32 page) const;
     bool                hasMargins(const u32 page) const;
     float           lineZoomFactor(const u32 firstPage, u32 &retWidth, u32 &retHeight) const;
+    float          computeLineZoom(const u32 firstPage, u32 &retWidth, u32 &retHeight) const;
+    ViewLayout          viewLayout() const;
+    void              updateLayout() const;
+    s32                   lineOfPage(const u32 page) const;
     void             updateVisible() const;
     QRect       getTrimmingForPage(s32 page) const;
     void               pageChanged();
+    void                scrollView();
+    void                updatePage(const u32 page);
     float                  maxYOff() const;
     void                adjustYOff(float offset);
     void           adjustFloorYOff(float offset);
@@ -187,13 +323,19 @@ class PDFViewer : public QWidget
     void          setViewMode(int newViewMode);
     void        setZoomFactor(float zoomFactor);
     void          refreshView();
+    void         refreshPages(const QList<u32> & pages);
+    void          fileIsValid();
     void     singleMouseClick();
+    void        prefetchPages();
+    void          pageDecoded(int page, float scale, int generation, QImage image);
+    void               search(const QString & text);
+    void              nextHit();
+    void          previousHit();
+    void            hitsFound(u32 page, const QList<QRectF> & boxes);
+    void       searchFinished();
 
   signals:
     void stateUpdated(ViewState & state);
 };
 
-extern void clearSingles(CustomTrim & customTrim);
-extern void  copySingles(CustomTrim &from, CustomTrim &to);
-
 #endif // PDFVIEWER_H
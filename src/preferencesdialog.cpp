@@ -5,6 +5,7 @@
 #include <QFileDialog>
 
 #include "bookmarksbrowser.h"
+#include "pagecodec.h"
 
 PreferencesDialog::PreferencesDialog(QWidget *parent) :
   QDialog(parent),
@@ -12,6 +13,10 @@ PreferencesDialog::PreferencesDialog(QWidget *parent) :
 {
   ui->setupUi(this);
 
+  for (const PageCodec * codec : PageCodec::available()) {
+    ui->pageCodecCombo->addItem(codec->name(), codec->id());
+  }
+
   connect(ui->clearRecentsButton,        SIGNAL(clicked()), this, SLOT(         clearRecentsList()));
   connect(ui->logFileButton,             SIGNAL(clicked()), this, SLOT(            selectLogFile()));
   connect(ui->setViewButton,             SIGNAL(clicked()), this, SLOT(           setDefaultView()));
@@ -36,10 +41,15 @@ void PreferencesDialog::setContent()
   ui->       geometryCB->setChecked(preferences.recentGeometry        );
   ui->        metricsCB->setChecked(preferences.showLoadMetrics       );
   ui->            logCB->setChecked(preferences.logTrace              );
+  ui->     vectorTrimCB->setChecked(preferences.vectorTrim            );
   ui->      logFileEdit->   setText(preferences.logFilename           );
   ui->horizontalPadding->  setValue(preferences.horizontalPadding     );
   ui->  verticalPadding->  setValue(preferences.verticalPadding       );
   ui-> doubleClickSpeed->  setValue(preferences.doubleClickSpeed      );
+  ui->   pageCodecCombo->setCurrentIndex(
+           qMax(ui->pageCodecCombo->findData(preferences.pageCodec), 0));
+  ui->      cacheBudget->  setValue(preferences.cacheBudget           );
+  ui->    diskCacheSize->  setValue(preferences.diskCacheSize         );
 
   ui->   bookmarksDbEnabledCB->setChecked(preferences.bookmarksParameters.bookmarksDbEnabled);
   ui->bookmarksDbFilenameEdit->   setText(preferences.bookmarksParameters.bookmarksDbFilename);
@@ -64,10 +74,14 @@ void PreferencesDialog::saveContent()
   preferences.recentGeometry          = ui->       geometryCB->isChecked();
   preferences.showLoadMetrics         = ui->        metricsCB->isChecked();
   preferences.logTrace                = ui->            logCB->isChecked();
+  preferences.vectorTrim              = ui->     vectorTrimCB->isChecked();
   preferences.logFilename             = ui->      logFileEdit->text();
   preferences.horizontalPadding       = ui->horizontalPadding->value();
   preferences.verticalPadding         = ui->  verticalPadding->value();
   preferences.doubleClickSpeed        = ui-> doubleClickSpeed->value();
+  preferences.pageCodec               = ui->   pageCodecCombo->currentData().toInt();
+  preferences.cacheBudget             = ui->      cacheBudget->value();
+  preferences.diskCacheSize           = ui->    diskCacheSize->value();
 
   preferences.bookmarksParameters.bookmarksDbEnabled  = ui->   bookmarksDbEnabledCB->isChecked();
   preferences.bookmarksParameters.bookmarksDbFilename = ui->bookmarksDbFilenameEdit->text();
@@ -29,6 +29,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <QObject>
 #include <QRect>
+#include <QVector>
 //#include <QtPdf>
 #include "cmake_cfg.h"
 
@@ -62,12 +63,11 @@ enum ViewMode {
 struct SinglePageTrim {
   int              page;
   QRect            pageTrim;
-  SinglePageTrim * next;
 };
 
 struct CustomTrim {
   QRect            odd, even;
-  SinglePageTrim * singles;
+  QVector<SinglePageTrim> singles;  // Sorted by page, looked up by binary search
   bool             initialized;  // true if the struct contains valid data
   bool             similar;      // true if even and odd are the same
 };
@@ -100,6 +100,10 @@ struct Preferences {
   bool recentGeometry;
   bool showLoadMetrics;
   bool logTrace;
+  bool vectorTrim;
+  int  pageCodec;
+  int  cacheBudget;        // Compressed pages memory per document, in MB. 0: no limit
+  int  diskCacheSize;      // Rendered pages kept on disk, in MB. 0: disabled
   int  horizontalPadding;
   int  verticalPadding;
   int  doubleClickSpeed;
@@ -112,6 +116,7 @@ class BookmarksDB;
 
 // They are instantiated at the beginning of mainwindow.cpp
 extern u32           details;
+extern bool          codecBench;
 extern QString       filenameAtStartup;
 extern Preferences   preferences;
 extern BookmarksDB * bookmarksDB;